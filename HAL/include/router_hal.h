@@ -84,7 +84,7 @@ int HAL_GetInterfaceMacAddress(int if_index, macaddr_t o_mac);
  * @param length IN，接收缓存区大小
  * @param src_mac OUT，IPv4 报文下层的源 MAC 地址
  * @param dst_mac OUT，IPv4 报文下层的目的 MAC 地址
- * @param timeout IN，设置接收超时时间（毫秒），-1 表示无限等待
+ * @param timeout IN，设置接收超时时间（毫秒），-1 表示无限等待，0 表示每个接口只查看一次、不等待
  * @param if_index OUT，实际接收到的报文来源的接口号，不能为空指针
  * @return int >0 表示实际接收的报文长度，=0 表示超时返回，<0 表示发生错误
  */
@@ -225,11 +225,14 @@ int HAL_ReceiveIPPacket(int if_index_mask, uint8_t *buffer, size_t length,
   int64_t current_time = 0;
   // Round robin
   int current_port = 0;
+  // ports looked at so far: poll every port once even if timeout is 0
+  int polled = 0;
   struct pcap_pkthdr hdr;
   do {
     if ((if_index_mask & (1 << current_port)) == 0 ||
         !pcap_in_handles[current_port]) {
       current_port = (current_port + 1) % N_IFACE_ON_BOARD;
+      polled++;
       continue;
     }
 
@@ -309,8 +312,10 @@ int HAL_ReceiveIPPacket(int if_index_mask, uint8_t *buffer, size_t length,
     }
 
     current_port = (current_port + 1) % N_IFACE_ON_BOARD;
+    polled++;
     // -1 for infinity
-  } while ((current_time = HAL_GetTicks()) < begin + timeout || timeout == -1);
+  } while (polled < N_IFACE_ON_BOARD ||
+           (current_time = HAL_GetTicks()) < begin + timeout || timeout == -1);
   return 0;
 }
 
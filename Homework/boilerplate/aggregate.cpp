@@ -0,0 +1 @@
+../lookup/aggregate.cpp
\ No newline at end of file
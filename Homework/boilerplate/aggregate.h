@@ -0,0 +1 @@
+../lookup/aggregate.h
\ No newline at end of file
@@ -0,0 +1 @@
+../checksum/csum.cpp
\ No newline at end of file
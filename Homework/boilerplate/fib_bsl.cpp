@@ -0,0 +1 @@
+../lookup/fib_bsl.cpp
\ No newline at end of file
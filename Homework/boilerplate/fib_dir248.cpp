@@ -0,0 +1 @@
+../lookup/fib_dir248.cpp
\ No newline at end of file
@@ -0,0 +1 @@
+../lookup/fib_poptrie.cpp
\ No newline at end of file
@@ -0,0 +1 @@
+../lookup/fib_scan.cpp
\ No newline at end of file
@@ -0,0 +1 @@
+../lookup/fib_trie.cpp
\ No newline at end of file
@@ -1,32 +1,60 @@
 #include "rip.h"
 #include "router.h"
 #include "router_hal.h"
+#include "csum.h"
+#include "timer.h"
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
 extern uint16_t calculateIPChecksum(unsigned char *packet);
 
 extern bool validateIPChecksum(uint8_t *packet, size_t len);
 
+extern uint16_t calculateChecksum(const uint8_t *data, size_t len);
+
 extern void update(bool insert, RoutingTableEntry entry);
 
-extern bool query(uint32_t addr, uint32_t *nexthop, uint32_t *if_index, uint32_t *metric);
+extern bool query(uint32_t addr, uint32_t *nexthop, uint32_t *if_index);
+
+extern bool query_flow(uint32_t addr, uint32_t hash, uint32_t *nexthop, uint32_t *if_index);
+
+extern bool update_path(bool insert, RoutingTableEntry entry);
+
+extern uint32_t route_paths(int i, uint32_t *nexthop, uint32_t *if_index);
+
+extern uint32_t flow_hash(const uint8_t *packet, size_t len);
 
 extern bool forward(uint8_t *packet, size_t len);
 
+extern uint32_t forward_burst(uint8_t *const *packets, const size_t *len, size_t n);
+
 extern bool disassemble(const uint8_t *packet, uint32_t len, RipPacket *output);
 
+extern bool disassemble_view(const uint8_t *packet, uint32_t len, RipView *output);
+
 extern uint32_t assemble(const RipPacket *rip, uint8_t *buffer);
 
-extern RoutingTableEntry tableEntry[10000];
-extern uint32_t p; // 路由表总条数
+extern uint32_t assemble_csum(const RipPacket *rip, uint8_t *buffer, uint32_t *sum);
+
+extern int query_router_entry(uint32_t addr, uint32_t len);
+
+extern RouteEntry *tableEntry; // 路由表，容量会增长，update 之后需要重新取表项
+extern RouteInfo *tableInfo;   // 路由表中不常用的字段（nexthop 、from），与 tableEntry 一一对应
+extern uint32_t *tableVersion; // 路由表每 ROUTE_CHUNK_SIZE 项的修改计数
+extern int p; // 路由表总条数
 extern uint32_t un_mask[33];
+extern thread_local uint64_t dcache_hit, dcache_miss; // 本线程目的地址缓存的命中/未命中次数
 
 const uint32_t rip_multicast = 0x090000e0; // 组播IP 224.0.0.9
 //macaddr_t rip_mac = {0x01, 0x00, 0x5e, 0x00, 0x00, 0x09}; // 组播MAC
-uint8_t packet[2048]; // 收到的IP包
+
+#define ROUTER_BURST 32 // 一次最多收下的包数，不超过 forward_burst 一次能处理的个数
+
+uint8_t burst[ROUTER_BURST][2048]; // 一次收下的一组IP包
+uint8_t *packet; // 正在处理的IP包，指向 burst 中的一项
 uint8_t output[2048]; // 发出的IP包
 // 0: 10.0.0.1
 // 1: 10.0.1.1
@@ -61,24 +89,559 @@ uint32_t maskLength(uint32_t mask) {
     return p;
 }
 
+/**
+ * @brief 在 output 中构造针对 packet 的 ICMP 差错报文（RFC 792）：IP 头、ICMP 头、原包的 IP 头和前 8 字节
+ * @param type ICMP 类型，例如 11 为超时，3 为不可达
+ * @param code ICMP 代码
+ * @param src 差错报文的源地址（收到原包的接口的地址），大端序
+ * @param dst 差错报文的目的地址（原包的源地址），大端序
+ * @return 报文的长度
+ */
+uint32_t build_icmp_error(uint8_t type, uint8_t code, in_addr_t src, in_addr_t dst) {
+    const uint32_t len = 20 + 8 + 20 + 8;
+    memset(output, 0, 20 + 8);
+    put_uint8(output, 0, 0x45);
+    put_uint16(output, 2, len);
+    put_uint8(output, 8, 0xff);
+    put_uint8(output, 9, 0x01);
+    put_uint32(output, 12, ntohl(src));
+    put_uint32(output, 16, ntohl(dst));
+    put_uint16(output, 10, calculateIPChecksum(output));
+    put_uint8(output, 20, type);
+    put_uint8(output, 21, code);
+    memcpy(output + 28, packet, 20 + 8);
+    put_uint16(output, 22, calculateChecksum(output + 20, len - 20));
+    return len;
+}
+
+/*
+  每个接口发出的 RIP 包的 IP 头和 UDP 头除了目的地址和长度都是固定的，事先按接口构造好（目的地址为组播地址），
+  并算好不含目的地址和长度的 IP 头校验和与 UDP 校验和（含伪首部）的部分和。
+  发送时复制模板，填入目的地址和长度，把它们加到部分和上即可，不需要逐个字段构造和重新计算整个 IP 头的校验和。
+*/
+typedef struct {
+    uint8_t header[20 + 8]; // 长度和校验和字段为 0
+    uint32_t ip_sum;        // 折叠成 16 位的部分和，本机字节序
+    uint32_t udp_sum;
+} RipHeaderTemplate;
+
+RipHeaderTemplate rip_template[N_IFACE_ON_BOARD];
+
+// 把 32 位的值分成两个 16 位加到部分和上，结果不超过 32 位
+static inline uint32_t add32(uint32_t sum, uint32_t v) {
+    return sum + (v >> 16) + (v & 0xFFFF);
+}
+
+/**
+ * @brief 按接口的地址构造 RIP 包的 IP 头和 UDP 头模板，接口地址改变后需要重新调用
+ */
+void init_rip_templates() {
+    for (int i = 0; i < N_IFACE_ON_BOARD; i++) {
+        RipHeaderTemplate &t = rip_template[i];
+        uint8_t *h = t.header;
+        memset(h, 0, sizeof(t.header));
+        put_uint8(h, 0, 0x45); // ipv4 20字节
+        put_uint8(h, 8, 0x01); // TTL
+        put_uint8(h, 9, 0x11); // UDP
+        put_uint32(h, 12, ntohl(addrs[i])); // 源地址
+        put_uint16(h, 20, 0x0208); // UDP端口号
+        put_uint16(h, 22, 0x0208);
+        // 部分和中不含目的地址，模板中的组播地址只是默认值
+        t.ip_sum = (uint16_t) ~csum_fold(csum_partial(h, 20, 0));
+        t.udp_sum = (uint16_t) ~csum_fold(csum_partial(h + 20, 8, csum_pseudo_header(addrs[i], 0, 0x11, 0)));
+        put_uint32(h, 16, ntohl(rip_multicast)); // 目的地址
+    }
+}
+
+/**
+ * @brief 在 buffer 中构造 RIP 包（IP 头、UDP 头和 RIP 数据）
+ * @param if_index 发出的接口，源地址为该接口的地址
+ * @param dst 目的地址，大端序
+ * @param resp 要发送的 RIP 数据
+ * @param buffer 写入的位置，至少 RIP_PACKET_MAX 字节
+ * @return 包的长度
+ *
+ * IP 头和 UDP 头从 rip_template 复制，UDP 校验和在 assemble_csum 写入表项的同时计算。
+ */
+uint32_t build_rip(int if_index, in_addr_t dst, const RipPacket *resp, uint8_t *buffer) {
+    const RipHeaderTemplate &t = rip_template[if_index];
+    memcpy(buffer, t.header, sizeof(t.header));
+    if (dst != rip_multicast)
+        memcpy(buffer + 16, &dst, 4);
+
+    uint16_t udp_len = 8 + 4 + 20 * resp->numEntries;
+    uint16_t ip_len_n = htons(20 + udp_len), udp_len_n = htons(udp_len);
+    memcpy(buffer + 2, &ip_len_n, 2);
+    memcpy(buffer + 24, &udp_len_n, 2);
+
+    uint16_t ip_csum = csum_fold(add32(t.ip_sum, dst) + ip_len_n);
+    memcpy(buffer + 10, &ip_csum, 2);
+    // UDP 长度在伪首部和 UDP 头中各出现一次
+    uint32_t sum = add32(t.udp_sum, dst) + 2 * (uint32_t) udp_len_n;
+    assemble_csum(resp, &buffer[20 + 8], &sum);
+    uint16_t udp_csum = csum_fold(sum);
+    if (udp_csum == 0)
+        udp_csum = 0xFFFF; // 0 表示没有校验和，RFC 768
+    memcpy(buffer + 26, &udp_csum, 2);
+    return 20 + udp_len;
+}
+
+/**
+ * @brief 在 output 中构造 RIP 包并从 if_index 发出，参数同 build_rip
+ */
+void send_rip(int if_index, in_addr_t dst, const RipPacket *resp, macaddr_t mac) {
+    HAL_SendIPPacket(if_index, output, build_rip(if_index, dst, resp, output), mac);
+}
+
+/*
+  每个接口发出的完整路由表（经过水平分割）按路由表的块缓存成已经构造好的包：
+  第 c 个包对应表项 [c * ROUTE_CHUNK_SIZE, (c + 1) * ROUTE_CHUNK_SIZE) 中不是从这个接口学到的表项，
+  目的地址为组播地址。包记下生成时的 tableVersion[c] ，计数变了才重新生成，
+  所以定时通告和回复请求大多只需要直接发出缓存的包。
+  与逐项填满 25 项再分包相比，包的个数可能稍多，但一条路由的改动只影响一个包。
+*/
+#define RIP_PACKET_MAX (20 + 8 + 4 + RIP_MAX_ENTRY * 20)
+
+typedef struct {
+    uint8_t *data;     // 每块 RIP_PACKET_MAX 字节
+    uint32_t *len;     // 包长，0 表示这一块没有要通告的表项
+    uint32_t *version; // 生成时的 tableVersion
+    int cap;           // 能存放的块数
+} RipCache;
+
+RipCache rip_cache[N_IFACE_ON_BOARD];
+
+/**
+ * @brief 重新生成第 if_index 个接口的缓存中过期的包
+ * @return 当前路由表的块数，内存不足时返回 -1
+ */
+int refresh_rip_cache(int if_index) {
+    RipCache &cache = rip_cache[if_index];
+    int chunks = (p + ROUTE_CHUNK_SIZE - 1) / ROUTE_CHUNK_SIZE;
+    if (chunks > cache.cap) {
+        int cap = cache.cap ? cache.cap : 16;
+        while (cap < chunks)
+            cap *= 2;
+        uint8_t *data = (uint8_t *) realloc(cache.data, (size_t) cap * RIP_PACKET_MAX);
+        if (data == NULL)
+            return -1;
+        cache.data = data;
+        uint32_t *len = (uint32_t *) realloc(cache.len, cap * sizeof(uint32_t));
+        if (len == NULL)
+            return -1;
+        cache.len = len;
+        uint32_t *version = (uint32_t *) realloc(cache.version, cap * sizeof(uint32_t));
+        if (version == NULL)
+            return -1;
+        cache.version = version;
+        for (int c = cache.cap; c < cap; c++)
+            cache.len[c] = 0;
+        // 新的块标记为过期
+        for (int c = cache.cap; c < chunks; c++)
+            cache.version[c] = tableVersion[c] - 1;
+        for (int c = chunks; c < cap; c++)
+            cache.version[c] = 0;
+        cache.cap = cap;
+    }
+    for (int c = 0; c < chunks; c++) {
+        if (cache.version[c] == tableVersion[c])
+            continue;
+        RipPacket resp;
+        resp.numEntries = 0;
+        resp.command = 2; // response
+        int end = (c + 1) * ROUTE_CHUNK_SIZE < p ? (c + 1) * ROUTE_CHUNK_SIZE : p;
+        for (int j = c * ROUTE_CHUNK_SIZE; j < end; j++) {
+            if (tableEntry[j].if_index != if_index) { // 水平分割算法
+                resp.entries[resp.numEntries].addr = tableEntry[j].addr;
+                resp.entries[resp.numEntries].mask = un_mask[tableEntry[j].len];
+                resp.entries[resp.numEntries].nexthop = addrs[if_index];
+                resp.entries[resp.numEntries].metric = ntohl(tableEntry[j].metric);
+                resp.numEntries++;
+            }
+        }
+        cache.len[c] = resp.numEntries ? build_rip(if_index, rip_multicast, &resp, cache.data + c * RIP_PACKET_MAX) : 0;
+        cache.version[c] = tableVersion[c];
+    }
+    return chunks;
+}
+
+/**
+ * @brief 把缓存的包的目的地址改为 dst ，按 RFC 1624 增量更新 IP 头和 UDP 的校验和
+ */
+void retarget_rip(uint8_t *buffer, in_addr_t dst) {
+    uint16_t old_dst[2], new_dst[2], ip_csum, udp_csum;
+    memcpy(old_dst, buffer + 16, 4);
+    memcpy(new_dst, &dst, 4);
+    memcpy(&ip_csum, buffer + 10, 2);
+    memcpy(&udp_csum, buffer + 26, 2);
+    uint32_t delta = (uint16_t) ~old_dst[0] + (uint16_t) ~old_dst[1] + new_dst[0] + new_dst[1];
+    ip_csum = csum_fold((uint16_t) ~ip_csum + delta);
+    udp_csum = csum_fold((uint16_t) ~udp_csum + delta);
+    if (udp_csum == 0)
+        udp_csum = 0xFFFF;
+    memcpy(buffer + 16, &dst, 4);
+    memcpy(buffer + 10, &ip_csum, 2);
+    memcpy(buffer + 26, &udp_csum, 2);
+}
+
+/**
+ * @brief 从 if_index 发出完整的路由表
+ * @param dst 目的地址，大端序，不是组播地址时复制到 output 中修改目的地址后发出
+ * @param mac 目的 MAC 地址
+ */
+void send_rip_table(int if_index, in_addr_t dst, macaddr_t mac) {
+    int chunks = refresh_rip_cache(if_index);
+    const RipCache &cache = rip_cache[if_index];
+    for (int c = 0; c < chunks; c++) {
+        uint32_t len = cache.len[c];
+        if (len == 0)
+            continue;
+        uint8_t *data = cache.data + c * RIP_PACKET_MAX;
+        if (dst != rip_multicast) {
+            memcpy(output, data, len);
+            retarget_rip(output, dst);
+            data = output;
+        }
+        HAL_SendIPPacket(if_index, data, len, mac);
+    }
+}
+
+/*
+  触发更新（RFC 2453 3.10.1）：响应处理中改变了对外通告内容（是否存在、metric 、出接口）的路由记入 journal ，
+  触发更新只包含这些路由。发送一次触发更新之后随机等待 1~5 秒，期间的改动积累起来到时一起发送，
+  同一条路由改动多次只发送一次。定时的完整通告包含了所有路由，发送之后清空 journal 。
+*/
+typedef struct {
+    uint32_t addr; // 大端序
+    uint32_t len;
+} RouteKey;
+
+RouteKey *journal = NULL;
+int journal_size = 0, journal_cap = 0;
+uint64_t trigger_time = 0; // 在这个时间之前不发送触发更新
+
+// 路由对外通告的状态，没有这条路由时为 ROUTE_STATE_NONE
+#define ROUTE_STATE_NONE 0xFFFFFFFF
+
+uint32_t route_state(uint32_t addr, uint32_t len) {
+    int i = query_router_entry(addr, len);
+    return i < 0 ? ROUTE_STATE_NONE : tableEntry[i].metric | tableEntry[i].if_index << 8;
+}
+
+/**
+ * @brief 记录一条通告内容改变了的路由
+ */
+void journal_add(uint32_t addr, uint32_t len) {
+    if (journal_size == journal_cap) {
+        int cap = journal_cap ? journal_cap * 2 : 64;
+        RouteKey *j = (RouteKey *) realloc(journal, cap * sizeof(RouteKey));
+        if (j == NULL)
+            return; // 内存不足时只能等定时的完整通告
+        journal = j;
+        journal_cap = cap;
+    }
+    journal[journal_size++] = {addr, len};
+}
+
+static int route_key_cmp(const void *a, const void *b) {
+    const RouteKey *x = (const RouteKey *) a, *y = (const RouteKey *) b;
+    if (x->addr != y->addr)
+        return x->addr < y->addr ? -1 : 1;
+    return (int) x->len - (int) y->len;
+}
+
+/**
+ * @brief 向每个接口发送 journal 中的路由，然后清空 journal
+ *
+ * 路由按当前的状态通告，经过水平分割；已经删除的路由以 metric 16 通告给所有接口。
+ */
+void send_triggered_update() {
+    qsort(journal, journal_size, sizeof(RouteKey), route_key_cmp);
+    int n = 0;
+    for (int k = 0; k < journal_size; k++)
+        if (n == 0 || route_key_cmp(&journal[n - 1], &journal[k]) != 0)
+            journal[n++] = journal[k];
+    macaddr_t rip_mac = {0x01, 0x00, 0x5e, 0x00, 0x00, 0x09}; // 组播MAC地址
+    for (int i = 0; i < N_IFACE_ON_BOARD; i++) {
+        printf("send %08x > %08x @ %d triggered update, %d routes\n", addrs[i], rip_multicast, i, n);
+        RipPacket resp;
+        resp.numEntries = 0;
+        resp.command = 2; // response
+        for (int k = 0; k < n; k++) {
+            int j = query_router_entry(journal[k].addr, journal[k].len);
+            if (j >= 0 && tableEntry[j].if_index == i)
+                continue; // 水平分割算法
+            resp.entries[resp.numEntries].addr = journal[k].addr;
+            resp.entries[resp.numEntries].mask = un_mask[journal[k].len];
+            resp.entries[resp.numEntries].nexthop = addrs[i];
+            resp.entries[resp.numEntries].metric = ntohl(j >= 0 ? tableEntry[j].metric : RIP_INFINITY);
+            if (++resp.numEntries == RIP_MAX_ENTRY) {
+                send_rip(i, rip_multicast, &resp, rip_mac);
+                resp.numEntries = 0;
+            }
+        }
+        if (resp.numEntries > 0)
+            send_rip(i, rip_multicast, &resp, rip_mac);
+    }
+    journal_size = 0;
+}
+
+/*
+  路由的超时和垃圾回收（RFC 2453 3.8）：学到的路由 ROUTE_TIMEOUT_MS 内没有再从它的下一跳收到就置为不可达（metric 16），
+  并作为触发更新通告出去；再过 ROUTE_GC_MS 仍然不可达就删除。直连路由不超时。
+  每条路由最多一个定时器，编号记在 tableInfo 中，定时器的数据是路由的 addr 和 len 。
+  有等价路径时每条路径分别超时：收到通告时只记下对应路径的时间（tableInfo 的 path_time），
+  定时器不晚于最早的那条路径到期，到期时去掉已经超时的路径，再按剩下路径中最早的重新计时；全部超时才置为不可达。
+*/
+#define ROUTE_TIMEOUT_MS (180 * 1000)
+#define ROUTE_GC_MS (120 * 1000)
+
+/**
+ * @brief 设置第 i 条路由的定时器，没有就添加一个
+ */
+void set_route_timer(int i, uint64_t expire) {
+    if (tableInfo[i].timer == ROUTE_TIMER_NONE)
+        tableInfo[i].timer = timer_add(expire, (uint64_t) tableEntry[i].len << 32 | tableEntry[i].addr);
+    else
+        timer_set(tableInfo[i].timer, expire);
+}
+
+/**
+ * @brief 路由的定时器到期：超时则置为不可达并开始垃圾回收，垃圾回收到期则删除
+ */
+void route_timer_expired(uint32_t id, uint64_t data, uint64_t now) {
+    uint32_t addr = (uint32_t) data, len = (uint32_t) (data >> 32);
+    int i = query_router_entry(addr, len);
+    if (i < 0 || tableInfo[i].timer != id) {
+        timer_del(id);
+        return;
+    }
+    RoutingTableEntry entry = {
+            .addr = addr,
+            .len = len,
+            .if_index = tableEntry[i].if_index,
+            .nexthop = tableInfo[i].nexthop,
+            .metric = RIP_INFINITY,
+            .from = tableInfo[i].from
+    };
+    if (tableEntry[i].metric < RIP_INFINITY) {
+        uint32_t path_nexthop[ECMP_MAX_PATHS], path_if[ECMP_MAX_PATHS];
+        uint32_t n_paths = route_paths(i, path_nexthop, path_if);
+        uint64_t next = 0; // 没有超时的路径中最早的到期时间
+        for (uint32_t k = 0; k < n_paths; k++) {
+            uint64_t expire = tableInfo[i].path_time[k] + ROUTE_TIMEOUT_MS;
+            if (expire > now && (next == 0 || expire < next))
+                next = expire;
+        }
+        if (next != 0) {
+            uint32_t state = route_state(addr, len);
+            // 从后往前删，前面路径的序号和 path_time 不变
+            for (uint32_t k = n_paths; k-- > 0;) {
+                if (tableInfo[i].path_time[k] + ROUTE_TIMEOUT_MS > now)
+                    continue;
+                printf("route %08x/%d via %08x timeout\n", addr, len, path_nexthop[k]);
+                entry.nexthop = path_nexthop[k];
+                entry.if_index = path_if[k];
+                update_path(false, entry); // 还有没超时的路径，不会删除表项；失败时留到下次到期再删
+            }
+            if (route_state(addr, len) != state)
+                journal_add(addr, len);
+            timer_set(id, next);
+            return;
+        }
+        printf("route %08x/%d timeout\n", addr, len);
+        update(true, entry); // 定时器编号不受影响
+        timer_set(id, now + ROUTE_GC_MS);
+        journal_add(addr, len);
+    } else {
+        printf("route %08x/%d garbage collected\n", addr, len);
+        timer_del(id);
+        update(false, entry);
+    }
+}
+
 void debug() {
     printf("\n======== ======== ======== ======== ======== ========\n");
     printf("addr     len      ifIndex  nextHop  metric   from\n");
     printf("======== ======== ======== ======== ======== ========\n");
     for (int i = 0; i < p; i++) {
         printf("%08x %02d       %02d       %08x %02d       %02d\n", tableEntry[i].addr, tableEntry[i].len, tableEntry[i].if_index,
-               tableEntry[i].nexthop, tableEntry[i].metric, tableEntry[i].from);
+               tableInfo[i].nexthop, tableEntry[i].metric, tableInfo[i].from);
     }
     printf("======== ======== ======== ======== ======== ========\n");
-    printf("Routing table scale: %08d\n\n", p);
+    printf("Routing table scale: %08d\n", p);
+    printf("Destination cache: %llu hit, %llu miss\n\n", (unsigned long long) dcache_hit,
+           (unsigned long long) dcache_miss);
 }
 
-int query_router_entry(uint32_t addr, uint32_t len) {
-    for (int i = 0; i < p; ++i) {
-        if (tableEntry[i].addr == addr && tableEntry[i].len == len)
-            return i;
+/**
+ * @brief 处理一个已经检查过 IP 头并更新了 TTL 的包，包在 packet 中
+ * @param res 包的长度
+ * @param if_index 收到包的接口
+ * @param src_mac 包的源 MAC 地址
+ * @param time 当前时间，用于路由的超时计时
+ */
+void handle_packet(int res, int if_index, macaddr_t src_mac, uint64_t time) {
+    in_addr_t src_addr = (packet[12] << 0) | (packet[13] << 8) | (packet[14] << 16) | (packet[15] << 24);
+    in_addr_t dst_addr = (packet[16] << 0) | (packet[17] << 8) | (packet[18] << 16) | (packet[19] << 24);
+    // extract src_addr and dst_addr from packet
+    // big endian
+
+    // 2. check whether dst is me
+    bool dst_is_me = false;
+    for (int i = 0; i < N_IFACE_ON_BOARD; i++) {
+        if (memcmp(&dst_addr, &addrs[i], sizeof(in_addr_t)) == 0) {
+            dst_is_me = true;
+            break;
+        }
+    }
+    // TODO: Handle rip multicast address(224.0.0.9)?
+    dst_is_me |= (dst_addr == rip_multicast);
+
+    if (dst_is_me) {
+        // 3a.1
+        RipView rip; // 直接读 packet 中的表项，不复制
+        // check and validate
+        if (disassemble_view(packet, res, &rip)) {
+            if (rip.command == 1) { // receive a request
+                printf("recv %08x > %08x request\n", src_addr, dst_addr);
+                // 3a.3 request, ref. RFC2453 3.9.1
+                // only need to respond to whole table requests in the lab
+                printf("send %08x > %08x response\n", addrs[if_index], src_addr);
+                send_rip_table(if_index, src_addr, src_mac);
+            } else { // receive a response
+                // 3a.2 response, ref. RFC2453 3.9.2
+                // update routing table
+                // new metric = ?
+                // update metric, if_index, nexthop
+                // what is missing from RoutingTableEntry?
+                // TODO: use query and update
+                // triggered updates? ref. RFC2453 3.10.1
+                printf("recv %08x > %08x response\n", src_addr, dst_addr);
+                //uint32_t nxthop, if_idx, metric;
+                for (uint32_t i = 0; i < rip.numEntries; i++) {
+                    /*if (!query(rip.entries[i].addr, &nxthop, &if_idx, &metric) ||
+                        ntohl(rip.entries[i].metric) < metric || // 收到的metric 小于自己的 metric
+                        nxthop == src_addr) {
+                        RoutingTableEntry entry = {
+                                .addr = rip.entries[i].addr & un_mask[maskLength(ntohl(rip.entries[i].mask))],
+                                .len = maskLength(ntohl(rip.entries[i].mask)),
+                                .if_index = (uint32_t) if_index,
+                                .nexthop = src_addr,
+                                .metric = ntohl(rip.entries[i].metric),
+                                .from = if_index
+                        };
+                        update(true, entry);
+                    }
+                     */
+                    uint32_t metric = ntohl(rip_view_metric(&rip, i)) + 1; // 新的metrix为收到的metrix+1
+                    uint32_t len = maskLength(ntohl(rip_view_mask(&rip, i)));
+                    RoutingTableEntry entry = {
+                            .addr = rip_view_addr(&rip, i) & un_mask[len],
+                            .len = len,
+                            .if_index = (uint32_t) if_index,
+                            .nexthop = src_addr,
+                            .metric = metric,
+                            .from = (uint32_t) if_index
+                    };
+                    // 所有修改都经过 update ，以保持 FIB 与路由表同步
+                    int idx = query_router_entry(entry.addr, len);
+                    uint32_t state = route_state(entry.addr, len);
+                    uint32_t timer = idx >= 0 ? tableInfo[idx].timer : ROUTE_TIMER_NONE;
+                    bool reachable = idx >= 0 && tableEntry[idx].metric < RIP_INFINITY;
+                    if (idx >= 0) {  // 若查找到则为表项序号，否则为-1
+                        const RouteEntry &rte = tableEntry[idx]; // 查找到的表项的引用
+                        if (tableInfo[idx].nexthop == 0)
+                            continue; // 如果是直连路由则直接跳过
+                        // 这条路由（的某条等价路径）是否就是经过发送者的
+                        uint32_t path_nexthop[ECMP_MAX_PATHS], path_if[ECMP_MAX_PATHS];
+                        uint32_t n_paths = route_paths(idx, path_nexthop, path_if);
+                        bool via_sender = false;
+                        for (uint32_t k = 0; k < n_paths; k++)
+                            via_sender |= path_nexthop[k] == src_addr && path_if[k] == (uint32_t) if_index;
+                        if (via_sender) {
+                            if (metric > 16) {
+                                update_path(false, entry); // 删除这条路径，是最后一条时删除表项
+                            } else if (metric == rte.metric) {
+                                // 没有变化
+                            } else if (n_paths == 1 || metric < rte.metric) {
+                                update(true, entry); // 变好的路径成为唯一的最短路径
+                            } else {
+                                update_path(false, entry); // 等价路径中的一条变差了，去掉它
+                            }
+                        } else if (metric < rte.metric) {
+                            update(true, entry);
+                        } else if (metric == rte.metric && metric < 16) {
+                            update_path(true, entry); // 等价路径（ECMP）
+                        }
+                        // 没有查到，且metrix小于16，一定是直接插入新的表项
+                    } else if (metric <= 16) {
+                        update(true, entry);
+                    }
+                    if (route_state(entry.addr, len) != state)
+                        journal_add(entry.addr, len);
+                    // 从下一跳收到可达的路由时记下这条路径的时间，重新开始它的超时计时；
+                    // 刚变为不可达的路由开始垃圾回收计时，一直不可达的不重新开始
+                    idx = query_router_entry(entry.addr, len);
+                    if (idx < 0) {
+                        if (timer != ROUTE_TIMER_NONE)
+                            timer_del(timer);
+                    } else if (tableEntry[idx].metric < RIP_INFINITY) {
+                        uint32_t path_nexthop[ECMP_MAX_PATHS], path_if[ECMP_MAX_PATHS];
+                        uint32_t n_paths = route_paths(idx, path_nexthop, path_if);
+                        for (uint32_t k = 0; k < n_paths; k++)
+                            if (path_nexthop[k] == src_addr && path_if[k] == (uint32_t) if_index)
+                                tableInfo[idx].path_time[k] = time;
+                        // 已有的定时器不晚于各条路径的到期时间，到期时再按路径的时间重新计时
+                        if (tableInfo[idx].timer == ROUTE_TIMER_NONE)
+                            set_route_timer(idx, time + ROUTE_TIMEOUT_MS);
+                    } else if (reachable || tableInfo[idx].timer == ROUTE_TIMER_NONE) {
+                        set_route_timer(idx, time + ROUTE_GC_MS);
+                    }
+                }
+            }
+        } else {
+            printf("recv %08x > %08x misformed\n", src_addr, dst_addr);
+        }
+    } else {
+        // 3b.1 dst is not me
+        // forward
+        // beware of endianness
+        uint32_t nexthop, dest_if;
+        // 有等价路径时按流选择，同一个流的包走同一条路径
+        if (query_flow(dst_addr, flow_hash(packet, res), &nexthop, &dest_if)) { // 目的地址找到了（不可达的路由不在 FIB 中）
+            // found
+            macaddr_t dest_mac;
+            // direct routing
+            if (nexthop == 0) {
+                nexthop = dst_addr;
+            }
+            if (HAL_ArpGetMacAddress(dest_if, nexthop, dest_mac) == 0) { // 算出下一跳的dest_mac
+                // found
+                memcpy(output, packet, res);
+                // update ttl and checksum
+                // forward(output, res);
+                // TODO: you might want to check ttl=0 case
+                if (output[8]) { // TTL > 0
+                    HAL_SendIPPacket(dest_if, output, res, dest_mac);
+                } else { // 构造ICMP time exceeded
+                    // time exceeded
+                    uint32_t icmp_len = build_icmp_error(11, 0, addrs[if_index], src_addr);
+                    HAL_SendIPPacket(if_index, output, icmp_len, src_mac);
+                }
+            } else { // 有IP地址但无MAC地址
+                // not found
+                // you can drop it
+                //printf("ARP not found for %x\n", nexthop);
+            }
+        } else {
+            // not found
+            // optionally you can send ICMP Host Unreachable
+            //printf("IP not found for %x\n", src_addr);
+            uint32_t icmp_len = build_icmp_error(11, 0, addrs[if_index], src_addr);
+            HAL_SendIPPacket(if_index, output, icmp_len, src_mac);
+        }
     }
-    return -1;
 }
 
 int main(int argc, char *argv[]) {
@@ -87,6 +650,9 @@ int main(int argc, char *argv[]) {
     if (res < 0) {
         return res;
     }
+    init_rip_templates();
+    timer_init(HAL_GetTicks());
+    srand(time(NULL) ^ addrs[0]); // 各个路由器的触发更新等待时间不同
 
     // 0b. Add direct routes
     // For example:
@@ -109,6 +675,7 @@ int main(int argc, char *argv[]) {
     uint64_t last_time = 0; // 开始时间
     while (1) {
         uint64_t time = HAL_GetTicks();
+        timer_run(time, route_timer_expired);
         /*
         if (time > last_time + 30 * 1000) {
           // What to do?
@@ -124,303 +691,67 @@ int main(int argc, char *argv[]) {
 
             for (int i = 0; i < 4; i++) {
                 printf("send %08x > %08x @ %d response\n", addrs[i], rip_multicast, i);
-                RipPacket resp;
-
-                put_uint8(output, 0, 0x45); // ipv4 20字节
-                put_uint8(output, 8, 0x01); // TTL
-                put_uint8(output, 9, 0x11); // UDP
-
-                put_uint32(output, 12, ntohl(addrs[i])); // 源地址
-                put_uint32(output, 16, ntohl(rip_multicast)); // 目的地址
-
-                put_uint16(output, 20, 0x0208); // UDP端口号
-                put_uint16(output, 22, 0x0208); //
-
-                resp.numEntries = 0; // 转发表项数
-                resp.command = 2; // response
-                for (int j = 0; j < p; j++) { // 路由表里的项全加入转发表
-                    if (tableEntry[j].if_index != i) {
-                        resp.entries[resp.numEntries].addr = tableEntry[j].addr;
-                        resp.entries[resp.numEntries].mask = un_mask[tableEntry[j].len];
-                        //resp.entries[resp.numEntries].nexthop = tableEntry[j].nexthop;
-                        resp.entries[resp.numEntries].nexthop = addrs[i];
-                        resp.entries[resp.numEntries].metric = ntohl(tableEntry[j].metric);
-                        resp.numEntries++;
-
-                        if (resp.numEntries == 25) {
-                            uint32_t rip_len = assemble(&resp, &output[20 + 8]);
-                            put_uint16(output, 2, 20 + 8 + rip_len);
-                            put_uint16(output, 24, 8 + rip_len);
-                            put_uint16(output, 10, calculateIPChecksum(output));
-                            // printf("send %08x > %08x response\n", addrs[if_index], src_addr);
-                            macaddr_t rip_mac = {0x01, 0x00, 0x5e, 0x00, 0x00, 0x09}; // 组播MAC地址
-                            HAL_SendIPPacket(i, output, rip_len + 20 + 8, rip_mac);
-                            resp.numEntries = 0;
-                        }
-                    }
-                }
-                if (resp.numEntries == 0) continue;
-                //printf("send %08x > %08x response222\n", 2, 2);
-                uint32_t rip_len = assemble(&resp, &output[20 + 8]);
-
-                put_uint16(output, 2, 20 + 8 + rip_len);
-                put_uint16(output, 24, 8 + rip_len);
-
-                put_uint16(output, 10, calculateIPChecksum(output));
-
                 macaddr_t rip_mac = {0x01, 0x00, 0x5e, 0x00, 0x00, 0x09}; // 组播MAC地址
-                HAL_SendIPPacket(i, output, 20 + 8 + rip_len, rip_mac);
-                //printf("send %08x > %08x response333\n", 3, 3);
+                send_rip_table(i, rip_multicast, rip_mac);
             }
 
             last_time = time;
+            journal_size = 0; // 完整通告已经包含了所有改动
+        } else if (journal_size > 0 && time >= trigger_time) {
+            send_triggered_update();
+            trigger_time = time + 1000 + rand() % 4001; // 随机等待 1~5 秒
         }
 
         int mask = (1 << N_IFACE_ON_BOARD) - 1;
-        macaddr_t src_mac;
-        macaddr_t dst_mac;
-        int if_index;
-        res = HAL_ReceiveIPPacket(mask, packet, sizeof(packet), src_mac, dst_mac,
-                                  1000, &if_index);
-        if (res == HAL_ERR_EOF) {
-            break;
-        } else if (res < 0) {
-            return res;
-        } else if (res == 0) {
-            // Timeout
-            continue;
-        } else if (res > sizeof(packet)) {
-            // packet is truncated, ignore it
-            continue;
-        }
-
-        // 1. validate
-        if (!forward(packet, res)) {
-            printf("Invalid IP Checksum\n");
-            continue;
-        }
-
-        in_addr_t src_addr = (packet[12] << 0) | (packet[13] << 8) | (packet[14] << 16) | (packet[15] << 24);
-        in_addr_t dst_addr = (packet[16] << 0) | (packet[17] << 8) | (packet[18] << 16) | (packet[19] << 24);
-        // extract src_addr and dst_addr from packet
-        // big endian
-
-        // 2. check whether dst is me
-        bool dst_is_me = false;
-        for (int i = 0; i < N_IFACE_ON_BOARD; i++) {
-            if (memcmp(&dst_addr, &addrs[i], sizeof(in_addr_t)) == 0) {
-                dst_is_me = true;
+        uint8_t *packets[ROUTER_BURST];
+        size_t lens[ROUTER_BURST];
+        macaddr_t src_macs[ROUTER_BURST];
+        int if_indices[ROUTER_BURST];
+        size_t n = 0;
+        bool eof = false;
+        // 第一个包最多等待 1 秒，之后不再等待，把各个接口上已经到达的包一起收下
+        // （timeout 为 0 时 HAL 把每个接口查看一次）
+        while (n < ROUTER_BURST) {
+            macaddr_t dst_mac;
+            res = HAL_ReceiveIPPacket(mask, burst[n], sizeof(burst[n]), src_macs[n], dst_mac,
+                                      n ? 0 : 1000, &if_indices[n]);
+            if (res == HAL_ERR_EOF) {
+                eof = true;
                 break;
+            } else if (res < 0) {
+                return res;
+            } else if (res == 0) {
+                // Timeout
+                break;
+            } else if (res > sizeof(burst[n])) {
+                // packet is truncated, ignore it
+                continue;
             }
+            packets[n] = burst[n];
+            lens[n++] = res;
         }
-        // TODO: Handle rip multicast address(224.0.0.9)?
-        dst_is_me |= (dst_addr == rip_multicast);
-
-        if (dst_is_me) {
-            // 3a.1
-            RipPacket rip;
-            // check and validate
-            if (disassemble(packet, res, &rip)) {
-                if (rip.command == 1) { // receive a request
-                    printf("recv %08x > %08x request\n", src_addr, dst_addr);
-                    // 3a.3 request, ref. RFC2453 3.9.1
-                    // only need to respond to whole table requests in the lab
-                    RipPacket resp;
-
-                    put_uint8(output, 0, 0x45);
-                    put_uint8(output, 8, 0x01);
-                    put_uint8(output, 9, 0x11);
-
-                    put_uint32(output, 12, ntohl(addrs[if_index]));
-                    put_uint32(output, 16, ntohl(src_addr));
-
-                    put_uint16(output, 20, 0x0208);
-                    put_uint16(output, 22, 0x0208);
-
-                    resp.numEntries = 0;
-                    resp.command = 2;
-                    for (int i = 0; i < p; i++) {
-                        if (tableEntry[i].if_index != if_index) { // 水平分割算法
-                            resp.entries[resp.numEntries].addr = tableEntry[i].addr;
-                            resp.entries[resp.numEntries].mask = un_mask[tableEntry[i].len];
-                            resp.entries[resp.numEntries].nexthop = addrs[if_index];
-                            resp.entries[resp.numEntries].metric = ntohl(tableEntry[i].metric);
-                            resp.numEntries++;
-
-                            if (resp.numEntries == 25) {
-                                uint32_t rip_len = assemble(&resp, &output[20 + 8]);
-                                put_uint16(output, 2, 20 + 8 + rip_len);
-                                put_uint16(output, 24, 8 + rip_len);
-                                put_uint16(output, 10, calculateIPChecksum(output));
-                                // printf("send %08x > %08x response\n", addrs[if_index], src_addr);
-                                HAL_SendIPPacket(if_index, output, rip_len + 20 + 8, src_mac);
-                                resp.numEntries = 0;
-                            }
-                        }
-                    }
-                    // TODO: fill resp
-                    // assemble
-                    // IP
-                    //output[0] = 0x45;
-                    // ...
-                    // UDP
-                    // port = 520
-                    //output[20] = 0x02;
-                    //output[21] = 0x08;
-                    // ...
-                    // RIP
-                    if (resp.numEntries == 0) {
-                        continue;
-                    }
-                    uint32_t rip_len = assemble(&resp, &output[20 + 8]);
-                    // checksum calculation for ip and udp
-                    // if you don't want to calculate udp checksum, set it to zero
-                    // send it back
-                    put_uint16(output, 2, 20 + 8 + rip_len);
-                    put_uint16(output, 24, 8 + rip_len);
-
-                    put_uint16(output, 10, calculateIPChecksum(output));
-
-                    printf("send %08x > %08x response\n", addrs[if_index], src_addr);
-                    HAL_SendIPPacket(if_index, output, rip_len + 20 + 8, src_mac);
-                    //printf("send %08x > %08x response222\n", addrs[if_index], src_addr);
-                } else { // receive a response
-                    // 3a.2 response, ref. RFC2453 3.9.2
-                    // update routing table
-                    // new metric = ?
-                    // update metric, if_index, nexthop
-                    // what is missing from RoutingTableEntry?
-                    // TODO: use query and update
-                    // triggered updates? ref. RFC2453 3.10.1
-                    printf("recv %08x > %08x response\n", src_addr, dst_addr);
-                    //uint32_t nxthop, if_idx, metric;
-                    for (int i = 0; i < rip.numEntries; i++) {
-                        /*if (!query(rip.entries[i].addr, &nxthop, &if_idx, &metric) ||
-                            ntohl(rip.entries[i].metric) < metric || // 收到的metric 小于自己的 metric
-                            nxthop == src_addr) {
-                            RoutingTableEntry entry = {
-                                    .addr = rip.entries[i].addr & un_mask[maskLength(ntohl(rip.entries[i].mask))],
-                                    .len = maskLength(ntohl(rip.entries[i].mask)),
-                                    .if_index = (uint32_t) if_index,
-                                    .nexthop = src_addr,
-                                    .metric = ntohl(rip.entries[i].metric),
-                                    .from = if_index
-                            };
-                            update(true, entry);
-                        }
-                         */
-                        RipEntry &r_entry = rip.entries[i];
-                        int metric = ntohl(r_entry.metric) + 1; // 新的metrix为收到的metrix+1
-                        uint32_t len = maskLength(ntohl(r_entry.mask));
-                        int idx = query_router_entry(r_entry.addr, len);
-                        if (idx >= 0) {  // 若查找到则为表项序号，否则为-1
-                            RoutingTableEntry &rte = tableEntry[idx]; // 查找到的表项的引用
-                            if (rte.nexthop == 0)
-                                continue; // 如果是直连路由则直接跳过
-                            if (rte.if_index == if_index) {
-                                if (metric > 16) {
-                                    rte = tableEntry[--p]; // 直接操作数组删除表项
-                                } else {
-                                    rte.if_index = if_index;
-                                    rte.metric = (metric);
-                                    rte.nexthop = src_addr;
-				                    rte.from = if_index;
-                                }
-                            } else if (metric < (rte.metric)) {
-                                rte.if_index = if_index;
-                                rte.metric = (metric);
-                                rte.nexthop = src_addr;
-				                rte.from = if_index;
-                            }
-                            // 没有查到，且metrix小于16，一定是直接插入新的表项
-                        } else if (metric <= 16) { // 直接操作数组插入新的表项
-                            RoutingTableEntry &rte = tableEntry[p++];
-                            rte.addr = r_entry.addr;
-                            rte.if_index = if_index;
-                            rte.len = len;
-                            rte.metric = (metric);
-                            rte.nexthop = src_addr;
-			                rte.from = if_index;
-                        }
-                    }
-                }
-            } else {
-                printf("recv %08x > %08x misformed\n", src_addr, dst_addr);
+
+        // 1. validate
+        // 一组包一起检查 IP 头并更新 TTL ，通常全部通过，只需要判断一次
+        uint32_t pass = forward_burst(packets, lens, n);
+        if (pass == (n < 32 ? (1u << n) - 1 : ~0u)) {
+            for (size_t i = 0; i < n; i++) {
+                packet = packets[i];
+                handle_packet(lens[i], if_indices[i], src_macs[i], time);
             }
         } else {
-            // 3b.1 dst is not me
-            // forward
-            // beware of endianness
-            uint32_t nexthop, dest_if, met;
-            if (query(dst_addr, &nexthop, &dest_if, &met) && met < 16) { // 目的地址找到了
-                // found
-                macaddr_t dest_mac;
-                // direct routing
-                if (nexthop == 0) {
-                    nexthop = dst_addr;
+            // 没有通过的（带选项、TTL 将要超时或者非法）再逐个交给 forward
+            for (size_t i = 0; i < n; i++) {
+                packet = packets[i];
+                if (!(pass >> i & 1) && !forward(packet, lens[i])) {
+                    printf("Invalid IP Checksum\n");
+                    continue;
                 }
-                if (HAL_ArpGetMacAddress(dest_if, nexthop, dest_mac) == 0) { // 算出下一跳的dest_mac
-                    // found
-                    memcpy(output, packet, res);
-                    // update ttl and checksum
-                    // forward(output, res);
-                    // TODO: you might want to check ttl=0 case
-                    if (output[8]) { // TTL > 0
-                        HAL_SendIPPacket(dest_if, output, res, dest_mac);
-                    } else { // 构造ICMP time exceeded
-                        // time exceeded
-                        put_uint8(output, 0, 0x45);
-                        put_uint8(output, 8, 0xff);
-                        put_uint8(output, 9, 0x01);
-                        put_uint32(output, 12, ntohl(addrs[if_index]));
-                        put_uint32(output, 16, ntohl(src_addr));
-                        put_uint16(output, 10, calculateIPChecksum(output));
-                        put_uint8(output, 20, 11);
-                        for (int i = 0; i < 20 + 8; i++) {
-                            output[20 + i] = packet[i];
-                        }
-                        uint32_t check = 0;
-                        for (int i = 20; i < 56; i += 2) {
-                            uint16_t tmp = output[i];
-                            tmp = (tmp << 8) + output[i + 1];
-                            check += tmp;
-                        }
-                        while (check >> 16 != 0)
-                            check = (check >> 16) + (check & 0xffff);
-                        put_uint16(output, 22, (uint16_t) check);
-                        HAL_SendIPPacket(if_index, output, 56, src_mac);
-                    }
-                } else { // 有IP地址但无MAC地址
-                    // not found
-                    // you can drop it
-                    //printf("ARP not found for %x\n", nexthop);
-                }
-            } else {
-                // not found
-                // optionally you can send ICMP Host Unreachable
-                //printf("IP not found for %x\n", src_addr);
-                put_uint8(output, 0, 0x45);
-                put_uint8(output, 8, 0xff);
-                put_uint8(output, 9, 0x01);
-                put_uint32(output, 12, ntohl(addrs[if_index]));
-                put_uint32(output, 16, ntohl(src_addr));
-                put_uint16(output, 10, calculateIPChecksum(output));
-                put_uint8(output, 20, 11);
-                for (int i = 0; i < 20 + 8; i++) {
-                    output[20 + i] = packet[i];
-                }
-                uint32_t check = 0;
-                for (int i = 20; i < 56; i += 2) {
-                    uint16_t tmp = output[i];
-                    tmp = (tmp << 8) + output[i + 1];
-                    check += tmp;
-                }
-                while (check >> 16 != 0)
-                    check = (check >> 16) + (check & 0xffff);
-                put_uint16(output, 22, (uint16_t) check);
-                HAL_SendIPPacket(if_index, output, 56, src_mac);
+                handle_packet(lens[i], if_indices[i], src_macs[i], time);
             }
         }
+        if (eof)
+            break;
     }
     return 0;
 }
@@ -0,0 +1,142 @@
+#include "timer.h"
+#include <stdint.h>
+#include <stdlib.h>
+
+#define SLOT_BITS 6
+#define SLOTS (1 << SLOT_BITS)
+#define SLOT_NONE 0xFFFFFFFF // 不在任何槽中：已经到期或者已经删除
+#define SLOT_DRAIN (TIMER_LEVELS * SLOTS) // timer_run 正在处理的到期定时器，不属于任何刻度
+
+// 定时器连成双向链表挂在槽上，用数组下标代替指针，数组扩容时不需要修改链表
+typedef struct {
+    uint32_t prev, next;  // 链表中的前后项，没有时为 TIMER_NONE ；空闲的项用 next 连成空闲链表
+    uint32_t slot;        // 所在的槽 level * SLOTS + index ，或 SLOT_NONE
+    uint64_t expire;      // 到期的刻度
+    uint64_t data;
+} Timer;
+
+static Timer *timers = NULL;
+static uint32_t timer_cap = 0;
+static uint32_t free_list = TIMER_NONE;
+static uint32_t wheel[TIMER_LEVELS * SLOTS + 1]; // 每个槽的链表头，最后一个是 SLOT_DRAIN
+static uint64_t cur = 0;   // 下一个要处理的刻度
+static uint32_t pending = 0; // 挂在槽上的定时器个数
+
+static void unlink_timer(uint32_t id) {
+    Timer &t = timers[id];
+    if (t.slot == SLOT_NONE)
+        return;
+    if (t.prev != TIMER_NONE)
+        timers[t.prev].next = t.next;
+    else
+        wheel[t.slot] = t.next;
+    if (t.next != TIMER_NONE)
+        timers[t.next].prev = t.prev;
+    t.slot = SLOT_NONE;
+    pending--;
+}
+
+// 按到期刻度放入对应的层和槽，已经过期的放在下一个要处理的槽
+static void link_timer(uint32_t id) {
+    Timer &t = timers[id];
+    uint64_t expire = t.expire < cur ? cur : t.expire;
+    uint64_t delta = expire - cur;
+    int level = 0;
+    while (level < TIMER_LEVELS - 1 && delta >> (SLOT_BITS * (level + 1)))
+        level++;
+    if (delta >> (SLOT_BITS * TIMER_LEVELS)) // 超出范围的放在最高层能表示的最远处
+        expire = cur + ((uint64_t) 1 << (SLOT_BITS * TIMER_LEVELS)) - 1;
+    uint32_t slot = level * SLOTS + ((expire >> (SLOT_BITS * level)) & (SLOTS - 1));
+    t.slot = slot;
+    t.prev = TIMER_NONE;
+    t.next = wheel[slot];
+    if (t.next != TIMER_NONE)
+        timers[t.next].prev = id;
+    wheel[slot] = id;
+    pending++;
+}
+
+// 毫秒换算成刻度，向上取整，保证不会提前到期
+static inline uint64_t to_tick(uint64_t ms) {
+    return (ms + TIMER_TICK_MS - 1) / TIMER_TICK_MS;
+}
+
+void timer_init(uint64_t now) {
+    for (int i = 0; i <= SLOT_DRAIN; i++)
+        wheel[i] = TIMER_NONE;
+    cur = now / TIMER_TICK_MS;
+}
+
+uint32_t timer_add(uint64_t expire, uint64_t data) {
+    if (free_list == TIMER_NONE) {
+        uint32_t cap = timer_cap ? timer_cap * 2 : 64;
+        Timer *t = (Timer *) realloc(timers, cap * sizeof(Timer));
+        if (t == NULL)
+            return TIMER_NONE;
+        timers = t;
+        for (uint32_t i = timer_cap; i < cap; i++)
+            timers[i].next = i + 1 < cap ? i + 1 : TIMER_NONE;
+        free_list = timer_cap;
+        timer_cap = cap;
+    }
+    uint32_t id = free_list;
+    free_list = timers[id].next;
+    timers[id].data = data;
+    timers[id].expire = to_tick(expire);
+    link_timer(id);
+    return id;
+}
+
+void timer_set(uint32_t id, uint64_t expire) {
+    unlink_timer(id);
+    timers[id].expire = to_tick(expire);
+    link_timer(id);
+}
+
+void timer_del(uint32_t id) {
+    unlink_timer(id);
+    timers[id].next = free_list;
+    free_list = id;
+}
+
+// 把第 level 层第 index 个槽中的定时器重新放入时间轮，它们会落到更低的层
+static void cascade(int level, uint32_t index) {
+    uint32_t id = wheel[level * SLOTS + index];
+    wheel[level * SLOTS + index] = TIMER_NONE;
+    while (id != TIMER_NONE) {
+        uint32_t next = timers[id].next;
+        timers[id].slot = SLOT_NONE;
+        pending--;
+        link_timer(id);
+        id = next;
+    }
+}
+
+void timer_run(uint64_t now, TimerHandler handler) {
+    uint64_t end = now / TIMER_TICK_MS;
+    while (cur <= end) {
+        if (pending == 0) {
+            cur = end + 1; // 没有定时器时直接跳过
+            break;
+        }
+        uint32_t index = cur & (SLOTS - 1);
+        // 低层转完一圈时，依次把更高层中轮到的槽下放
+        for (int level = 1; index == 0 && level < TIMER_LEVELS; level++) {
+            index = (cur >> (SLOT_BITS * level)) & (SLOTS - 1);
+            cascade(level, index);
+        }
+        // 到期的定时器先移到 SLOT_DRAIN 再推进 cur ，处理函数中重新设置的定时器即使已经过期，
+        // 也只会放到下一个刻度的槽，不会在这一轮中再次被处理
+        uint32_t slot = cur & (SLOTS - 1);
+        for (uint32_t id = wheel[slot]; id != TIMER_NONE; id = timers[id].next)
+            timers[id].slot = SLOT_DRAIN;
+        wheel[SLOT_DRAIN] = wheel[slot];
+        wheel[slot] = TIMER_NONE;
+        cur++;
+        while (wheel[SLOT_DRAIN] != TIMER_NONE) {
+            uint32_t id = wheel[SLOT_DRAIN];
+            unlink_timer(id);
+            handler(id, timers[id].data, now);
+        }
+    }
+}
@@ -0,0 +1,52 @@
+#ifndef __TIMER_H__
+#define __TIMER_H__
+
+#include <stdint.h>
+
+/*
+  分层时间轮（hierarchical timing wheel）：时间按 TIMER_TICK_MS 毫秒划分成刻度，
+  共 TIMER_LEVELS 层，每层 64 个槽，第 l 层的一个槽对应 64^l 个刻度。
+  定时器按到期时间与当前时间之差放入能容纳它的最低一层，高层的槽轮到时把其中的定时器下放到低层。
+  添加、修改、删除都是常数时间，推进时间的代价只与经过的刻度数和到期的定时器数有关，与定时器总数无关。
+  定时器用编号表示，到期时调用处理函数，处理函数必须用 timer_set 重新设置或者用 timer_del 删除它。
+*/
+
+#define TIMER_TICK_MS 100
+#define TIMER_LEVELS 4
+#define TIMER_NONE 0xFFFFFFFF
+
+// 到期的处理函数：定时器编号、添加时给的数据、传给 timer_run 的当前时间
+typedef void (*TimerHandler)(uint32_t id, uint64_t data, uint64_t now);
+
+/**
+ * @brief 初始化时间轮
+ * @param now 当前时间，单位为毫秒（例如 HAL_GetTicks 的返回值）
+ */
+void timer_init(uint64_t now);
+
+/**
+ * @brief 添加一个定时器
+ * @param expire 到期时间，单位为毫秒
+ * @param data 到期时传给处理函数的数据
+ * @return 定时器编号，内存不足时返回 TIMER_NONE
+ */
+uint32_t timer_add(uint64_t expire, uint64_t data);
+
+/**
+ * @brief 修改定时器的到期时间，可以用于已经到期、正在处理的定时器
+ */
+void timer_set(uint32_t id, uint64_t expire);
+
+/**
+ * @brief 删除定时器，之后编号可能被重新使用
+ */
+void timer_del(uint32_t id);
+
+/**
+ * @brief 推进到 now ，对到期的定时器依次调用 handler
+ * @param now 当前时间，单位为毫秒
+ * @param handler 处理函数，其中可以添加、修改、删除定时器；设置为已经过期的时间时，最早在下一个刻度再次到期
+ */
+void timer_run(uint64_t now, TimerHandler handler);
+
+#endif
@@ -0,0 +1,128 @@
+#include "csum.h"
+#include <stdint.h>
+#include <string.h>
+#include <arpa/inet.h>
+#ifdef CSUM_X86
+#include <immintrin.h>
+#endif
+
+/*
+  各个实现都把数据按 32 位字累加到 64 位的累加器中（SIMD 版本是每个 64 位的通道各自累加），
+  64 位累加器在可以处理的包长内不会溢出，最后再折叠成 32 位的部分和。
+  末尾不足一个字的部分补零后累加，奇数长度时补在最后一个字节之后，与 RFC 1071 的约定一致。
+*/
+
+// 把 64 位的累加值折叠成 32 位，进位加回低位
+static inline uint32_t fold64(uint64_t sum) {
+    sum = (sum >> 32) + (sum & 0xFFFFFFFF);
+    sum = (sum >> 32) + (sum & 0xFFFFFFFF);
+    return (uint32_t) sum;
+}
+
+// 不足 4 字节的末尾，补零后按一个字读入
+static inline uint32_t load_tail(const uint8_t *p, size_t n) {
+    uint32_t v = 0;
+    memcpy(&v, p, n);
+    return v;
+}
+
+uint32_t csum_partial_scalar(const void *data, size_t len, uint32_t sum) {
+    const uint8_t *p = (const uint8_t *) data;
+    uint64_t acc = sum;
+    size_t i = 0;
+    for (; i + 16 <= len; i += 16) {
+        uint32_t w[4];
+        memcpy(w, p + i, 16);
+        acc += (uint64_t) w[0] + w[1] + w[2] + w[3];
+    }
+    for (; i + 4 <= len; i += 4) {
+        uint32_t w;
+        memcpy(&w, p + i, 4);
+        acc += w;
+    }
+    if (i < len)
+        acc += load_tail(p + i, len - i);
+    return fold64(acc);
+}
+
+#ifdef CSUM_X86
+__attribute__((target("sse2")))
+uint32_t csum_partial_sse2(const void *data, size_t len, uint32_t sum) {
+    const uint8_t *p = (const uint8_t *) data;
+    const __m128i zero = _mm_setzero_si128();
+    __m128i acc0 = zero, acc1 = zero;
+    size_t i = 0;
+    // 每次 32 字节，两个累加器交替使用，减少依赖链
+    for (; i + 32 <= len; i += 32) {
+        __m128i a = _mm_loadu_si128((const __m128i *) (p + i));
+        __m128i b = _mm_loadu_si128((const __m128i *) (p + i + 16));
+        acc0 = _mm_add_epi64(acc0, _mm_add_epi64(_mm_unpacklo_epi32(a, zero), _mm_unpackhi_epi32(a, zero)));
+        acc1 = _mm_add_epi64(acc1, _mm_add_epi64(_mm_unpacklo_epi32(b, zero), _mm_unpackhi_epi32(b, zero)));
+    }
+    if (i + 16 <= len) {
+        __m128i a = _mm_loadu_si128((const __m128i *) (p + i));
+        acc0 = _mm_add_epi64(acc0, _mm_add_epi64(_mm_unpacklo_epi32(a, zero), _mm_unpackhi_epi32(a, zero)));
+        i += 16;
+    }
+    acc0 = _mm_add_epi64(acc0, acc1);
+    uint64_t lanes[2];
+    _mm_storeu_si128((__m128i *) lanes, acc0);
+    uint64_t acc = (uint64_t) sum + fold64(lanes[0]) + fold64(lanes[1]);
+    return csum_partial_scalar(p + i, len - i, fold64(acc));
+}
+
+__attribute__((target("avx2")))
+uint32_t csum_partial_avx2(const void *data, size_t len, uint32_t sum) {
+    const uint8_t *p = (const uint8_t *) data;
+    const __m256i zero = _mm256_setzero_si256();
+    __m256i acc0 = zero, acc1 = zero;
+    size_t i = 0;
+    for (; i + 64 <= len; i += 64) {
+        __m256i a = _mm256_loadu_si256((const __m256i *) (p + i));
+        __m256i b = _mm256_loadu_si256((const __m256i *) (p + i + 32));
+        acc0 = _mm256_add_epi64(acc0, _mm256_add_epi64(_mm256_unpacklo_epi32(a, zero), _mm256_unpackhi_epi32(a, zero)));
+        acc1 = _mm256_add_epi64(acc1, _mm256_add_epi64(_mm256_unpacklo_epi32(b, zero), _mm256_unpackhi_epi32(b, zero)));
+    }
+    if (i + 32 <= len) {
+        __m256i a = _mm256_loadu_si256((const __m256i *) (p + i));
+        acc0 = _mm256_add_epi64(acc0, _mm256_add_epi64(_mm256_unpacklo_epi32(a, zero), _mm256_unpackhi_epi32(a, zero)));
+        i += 32;
+    }
+    acc0 = _mm256_add_epi64(acc0, acc1);
+    uint64_t lanes[4];
+    _mm256_storeu_si256((__m256i *) lanes, acc0);
+    uint64_t acc = (uint64_t) sum + fold64(lanes[0]) + fold64(lanes[1]) + fold64(lanes[2]) + fold64(lanes[3]);
+    return csum_partial_scalar(p + i, len - i, fold64(acc));
+}
+#endif
+
+static uint32_t (*csum_impl)(const void *data, size_t len, uint32_t sum) = NULL;
+
+// 根据 CPU 支持的指令集选择实现，第一次调用时执行
+static void select_csum() {
+    csum_impl = csum_partial_scalar;
+#ifdef CSUM_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        csum_impl = csum_partial_avx2;
+    else if (__builtin_cpu_supports("sse2"))
+        csum_impl = csum_partial_sse2;
+#endif
+}
+
+uint32_t csum_partial(const void *data, size_t len, uint32_t sum) {
+    // IP 头这样的短数据直接用标量版本，省去向量版本的收尾开销
+    if (len < 128)
+        return csum_partial_scalar(data, len, sum);
+    if (csum_impl == NULL)
+        select_csum();
+    return csum_impl(data, len, sum);
+}
+
+uint32_t csum_pseudo_header(uint32_t src, uint32_t dst, uint8_t proto, uint16_t len) {
+    // 伪首部：源地址、目的地址、0 、协议号、长度
+    uint16_t tail[2] = {htons(proto), htons(len)};
+    uint32_t t;
+    memcpy(&t, tail, 4);
+    return fold64((uint64_t) src + dst + t);
+}
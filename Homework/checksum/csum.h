@@ -0,0 +1,53 @@
+#ifndef __CSUM_H__
+#define __CSUM_H__
+
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+  因特网校验和（16 位反码和，RFC 1071）的计算核心，IP 头、ICMP 、UDP（伪首部 + 首部 + 数据）都可以使用。
+  反码和与字节序无关，所以按本机字节序读入数据累加，部分和也是按本机字节序表示的，
+  只有 csum_fold 的结果需要用 ntohs 换成网络序的数值（或者直接 memcpy 到包里）。
+  根据 CPU 支持的指令集在第一次调用时选择 AVX2 、SSE2 或普通的标量实现。
+*/
+
+/**
+ * @brief 把一段数据累加到部分和上
+ * @param data 数据，不要求对齐
+ * @param len 数据的长度，单位是字节
+ * @param sum 之前的部分和，没有则为 0
+ * @return 新的部分和（32 位，没有折叠）
+ *
+ * 分成几段累加时，除了最后一段，每段的长度都应该是偶数。
+ */
+uint32_t csum_partial(const void *data, size_t len, uint32_t sum);
+
+/**
+ * @brief 把部分和折叠成 16 位并取反，得到可以写入包中的校验和
+ * @return 校验和，本机字节序读出的值，写入时直接 memcpy 或者先用 ntohs 转换
+ */
+static inline uint16_t csum_fold(uint32_t sum) {
+    sum = (sum >> 16) + (sum & 0xFFFF);
+    sum = (sum >> 16) + (sum & 0xFFFF);
+    return (uint16_t) ~sum;
+}
+
+/**
+ * @brief UDP/TCP 伪首部的部分和
+ * @param src 源地址，大端序
+ * @param dst 目的地址，大端序
+ * @param proto 协议号，UDP 为 17
+ * @param len UDP/TCP 首部和数据的总长度
+ * @return 部分和，可以作为 csum_partial 的 sum 参数继续累加首部和数据
+ */
+uint32_t csum_pseudo_header(uint32_t src, uint32_t dst, uint8_t proto, uint16_t len);
+
+// 各个实现，供测试和性能比较使用，正常使用 csum_partial 即可
+uint32_t csum_partial_scalar(const void *data, size_t len, uint32_t sum);
+#if defined(__x86_64__) || defined(__i386__)
+#define CSUM_X86
+uint32_t csum_partial_sse2(const void *data, size_t len, uint32_t sum);  // CPU 需要支持 SSE2
+uint32_t csum_partial_avx2(const void *data, size_t len, uint32_t sum);  // CPU 需要支持 AVX2
+#endif
+
+#endif
@@ -0,0 +1 @@
+../checksum/csum.h
\ No newline at end of file
@@ -1,5 +1,15 @@
+#include "csum.h"
 #include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
+#include <arpa/inet.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define CRC32C_X86
+#endif
+
+// validate_burst 一次最多处理的包数（结果位图的位数）
+#define FORWARD_BURST_MAX 32
 
 /**
  * @brief 改变一个 uint8_t 型数组的连续两个字节的值
@@ -12,6 +22,51 @@ void put_uint16(uint8_t *out, size_t p, uint16_t v) {
     out[p + 1] = (v >> 0) & 0xFF;
 }
 
+/*
+  校验和是 16 位反码和，与字节序无关（RFC 1071）：直接按本机字节序一次读 32 位累加到 64 位中，
+  最后折叠成 16 位，得到的就是按本机字节序读出的校验和。所以比较和增量更新都不需要转换字节序，
+  只有要作为数值返回时才用 ntohs 换成网络序的值。
+*/
+
+// 把累加和折叠成 16 位反码和
+static inline uint16_t fold(uint64_t sum) {
+    sum = (sum >> 32) + (sum & 0xFFFFFFFF);
+    sum = (sum >> 16) + (sum & 0xFFFF);
+    sum = (sum >> 16) + (sum & 0xFFFF);
+    return (sum >> 16) + sum;
+}
+
+static inline uint32_t load32(const uint8_t *p) {
+    uint32_t v;
+    memcpy(&v, p, 4);
+    return v;
+}
+
+static inline uint16_t load16(const uint8_t *p) {
+    uint16_t v;
+    memcpy(&v, p, 2);
+    return v;
+}
+
+// IP 头所有 32 位字的和，常见的没有选项（IHL = 5）的情况展开
+static inline uint64_t header_sum(const uint8_t *packet, size_t header_len) {
+    uint64_t sum = (uint64_t) load32(packet) + load32(packet + 4) + load32(packet + 8) + load32(packet + 12) +
+                   load32(packet + 16);
+    for (size_t i = 20; i < header_len; i += 4)
+        sum += load32(packet + i);
+    return sum;
+}
+
+/**
+ * @brief 计算一段数据的校验和（例如 ICMP 、IP 头）
+ * @param data 数据，其中校验和字段应该已经清零
+ * @param len 数据的长度，单位是字节
+ * @return 校验和，网络序的值，可以直接用 put_uint16 写入
+ */
+uint16_t calculateChecksum(const uint8_t *data, size_t len) {
+    return ntohs(csum_fold(csum_partial(data, len, 0)));
+}
+
 /**
  * @brief 计算 IP 头的校验和
  * @param packet 完整的 IP 头和载荷
@@ -19,18 +74,10 @@ void put_uint16(uint8_t *out, size_t p, uint16_t v) {
  * @return 计算得出的 IP 头的校验和
  */
 uint16_t calculateIPChecksum(uint8_t *packet) {
-    uint8_t header_len = packet[0] & 0x0F; // number of 4-bytes
-    uint8_t packet10 = packet[10]; uint8_t packet11 = packet[11];
-    packet[10] = packet[11] = 0;
-    uint32_t sum = 0;
-    for (size_t i = 0; i < (uint32_t) header_len << 1; i++)
-        sum += packet[2 * i] << 8 | packet[2 * i + 1];
-    while (sum >> 16 > 0)
-        sum = (sum >> 16) + (sum & 0xFFFF);
-    sum = ~sum & 0xFFFF;
-    packet[10] = packet10; packet[11] = packet11;
-    // packet[10] = sum >> 8; packet[11] = sum & 0xFF;
-    return sum;
+    size_t header_len = (packet[0] & 0x0F) * 4;
+    // 反码和中加上 ~x 就是减去 x ，这样不需要把校验和字段先清零
+    uint64_t sum = (header_len >= 20 ? header_sum(packet, header_len) : 0) + (uint16_t) ~load16(packet + 10);
+    return ntohs((uint16_t) ~fold(sum));
 }
 
 /**
@@ -45,6 +92,16 @@ bool validateIPChecksum(uint8_t *packet, size_t len) {
     return new_sum == old_sum;
 }
 
+// TTL 减一，并按 RFC 1624 增量更新校验和
+static inline void decrement_ttl(uint8_t *packet) {
+    uint16_t m = load16(packet + 8);
+    packet[8]--;
+    uint16_t m_new = load16(packet + 8);
+    uint16_t hc = load16(packet + 10);
+    uint16_t hc_new = ~fold((uint64_t) (uint16_t) ~hc + (uint16_t) ~m + m_new);
+    memcpy(packet + 10, &hc_new, 2);
+}
+
 /**
  * @brief 进行转发时所需的 IP 头的更新：
  *        你需要先检查 IP 头校验和的正确性，如果不正确，直接返回 false ；
@@ -53,33 +110,138 @@ bool validateIPChecksum(uint8_t *packet, size_t len) {
  * @param packet 收到的 IP 包，既是输入也是输出，原地更改
  * @param len 即 packet 的长度，单位为字节
  * @return 校验和无误则返回 true ，有误则返回 false
+ *
+ * 包含校验和在内的整个 IP 头的反码和为 0xFFFF 时校验和正确；
+ * TTL 减一后按 RFC 1624 增量更新校验和：HC' = ~(~HC + ~m + m') ，m 和 m' 是 TTL 所在的 16 位字改动前后的值。
  */
 bool forward(uint8_t *packet, size_t len) {
-    uint8_t header_len = packet[0] & 0x0F; // number of 4-bytes
-    uint8_t packet10 = packet[10]; uint8_t packet11 = packet[11];
-    packet[10] = packet[11] = 0;
-    uint32_t sum = 0;
-    for (size_t i = 0; i < (uint32_t) header_len << 1; i++)
-        sum += packet[2 * i] << 8 | packet[2 * i + 1];
-    uint32_t total_sum = sum;
-    while (sum >> 16 > 0)
-        sum = (sum >> 16) + (sum & 0xFFFF);
-    sum = ~sum & 0xFFFF;
-    packet[10] = packet10; packet[11] = packet11;
-    // packet[10] = sum >> 8; packet[11] = sum & 0xFF;
-    // return sum;
-
-    uint16_t old_sum = (uint16_t) packet[10] << 8 | packet[11];
-    uint16_t new_sum = sum;
-    // return new_sum == old_sum;
-
-    if (new_sum != old_sum)
+    size_t header_len = (packet[0] & 0x0F) * 4;
+    if (header_len < 20 || len < header_len)
         return false;
-    packet[8]--;
-    sum = total_sum - (1 << 8);
-    while (sum >> 16 > 0)
-        sum = (sum >> 16) + (sum & 0xFFFF);
-    sum = ~sum & 0xFFFF;
-    put_uint16(packet, 10, sum);
+    if (fold(header_sum(packet, header_len)) != 0xFFFF)
+        return false;
+    decrement_ttl(packet);
     return true;
 }
+
+/**
+ * @brief 一次检查一组（burst）包的 IP 头，判断哪些包可以直接转发
+ * @param packets 各个包，每个缓冲区至少要有 20 字节可读（不要求都是包的内容）
+ * @param len 各个包的长度，单位为字节
+ * @param n 包的个数，不超过 FORWARD_BURST_MAX
+ * @return 第 i 位为 1 表示第 i 个包通过检查
+ *
+ * 通过检查的条件：版本为 4 且没有选项（IHL = 5），Total Length 在 [20, len] 内，TTL 大于 1 ，校验和正确。
+ * 没有通过的包不一定非法，例如带选项或者 TTL 即将超时的包，应该交给 forward 等逐个处理的慢路径。
+ *
+ * 先把每个包需要的字段和头部的部分和收集到按字段分开的数组里，再对数组逐项做不带分支的判断，
+ * 第二步是各个包之间没有依赖的整数运算，编译器可以跨包向量化。
+ */
+uint32_t validate_burst(uint8_t *const *packets, const size_t *len, size_t n) {
+    uint32_t ver_ihl[FORWARD_BURST_MAX], total[FORWARD_BURST_MAX], ttl[FORWARD_BURST_MAX];
+    uint32_t cap[FORWARD_BURST_MAX], sum[FORWARD_BURST_MAX], ok[FORWARD_BURST_MAX];
+    for (size_t i = 0; i < n; i++) {
+        const uint8_t *p = packets[i];
+        ver_ihl[i] = p[0];
+        total[i] = (uint32_t) p[2] << 8 | p[3];
+        ttl[i] = p[8];
+        cap[i] = len[i] < 0xFFFF ? (uint32_t) len[i] : 0xFFFF;
+        // 10 个 16 位字的和不超过 20 位，后面只需要 32 位运算
+        uint32_t s = 0;
+        for (int j = 0; j < 20; j += 4) {
+            uint32_t w = load32(p + j);
+            s += (w & 0xFFFF) + (w >> 16);
+        }
+        sum[i] = s;
+    }
+    for (size_t i = 0; i < n; i++) {
+        uint32_t s = (sum[i] >> 16) + (sum[i] & 0xFFFF);
+        s = (s >> 16) + (s & 0xFFFF);
+        ok[i] = (ver_ihl[i] == 0x45) & (total[i] >= 20) & (total[i] <= cap[i]) & (ttl[i] > 1) & (s == 0xFFFF);
+    }
+    uint32_t mask = 0;
+    for (size_t i = 0; i < n; i++)
+        mask |= ok[i] << i;
+    return mask;
+}
+
+/**
+ * @brief 对一组包做 forward 的检查和 TTL 更新，只处理 validate_burst 通过的包
+ * @param packets 各个包，既是输入也是输出，原地更改
+ * @param len 各个包的长度，单位为字节
+ * @param n 包的个数，不超过 FORWARD_BURST_MAX
+ * @return validate_burst 的结果，为 1 的位对应的包已经更新了 TTL 和校验和，其余的包没有改动
+ */
+uint32_t forward_burst(uint8_t *const *packets, const size_t *len, size_t n) {
+    uint32_t mask = validate_burst(packets, len, n);
+    for (uint32_t m = mask; m; m &= m - 1)
+        decrement_ttl(packets[__builtin_ctz(m)]);
+    return mask;
+}
+
+/*
+  等价多路径转发时用流的哈希值选择路径：同一个流（源、目的地址，协议，TCP/UDP 端口）的包走同一条路径，不会乱序。
+  哈希函数为 CRC32C ，CPU 支持 SSE4.2 时用 crc32 指令计算，否则查表。
+*/
+
+static uint32_t crc32c_table[256];
+
+static uint32_t crc32c_soft(uint32_t crc, const uint8_t *data, size_t n) {
+    for (size_t i = 0; i < n; i++)
+        crc = crc32c_table[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+    return crc;
+}
+
+#ifdef CRC32C_X86
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_sse42(uint32_t crc, const uint8_t *data, size_t n) {
+    // n 是 4 的倍数
+    for (size_t i = 0; i < n; i += 4) {
+        uint32_t v;
+        memcpy(&v, data + i, 4);
+        crc = _mm_crc32_u32(crc, v);
+    }
+    return crc;
+}
+#endif
+
+static uint32_t (*crc32c)(uint32_t crc, const uint8_t *data, size_t n) = NULL;
+
+// 第一次计算哈希时选择实现，软件实现的表也在这时生成
+static void select_crc32c() {
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t c = i;
+        for (int k = 0; k < 8; k++)
+            c = c & 1 ? (c >> 1) ^ 0x82F63B78 : c >> 1;
+        crc32c_table[i] = c;
+    }
+    crc32c = crc32c_soft;
+#ifdef CRC32C_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse4.2"))
+        crc32c = crc32c_sse42;
+#endif
+}
+
+/**
+ * @brief 计算 IP 包所属的流的哈希值，用于在等价路径中选择
+ * @param packet 完整的 IP 头和载荷
+ * @param len 即 packet 的长度，单位是字节
+ * @return 流的哈希值，同一个流的包结果相同
+ *
+ * 分片的包没有端口信息（除了第一片），所以分片的包只按地址和协议计算，保证同一个包的各片走同一条路径。
+ */
+uint32_t flow_hash(const uint8_t *packet, size_t len) {
+    if (crc32c == NULL)
+        select_crc32c();
+    uint8_t key[16] = {0}; // 源地址、目的地址、端口、协议
+    if (len < 20)
+        return 0;
+    memcpy(key, packet + 12, 8);
+    key[12] = packet[9];
+    size_t header_len = (packet[0] & 0x0F) * 4;
+    bool fragment = (packet[6] & 0x3F) || packet[7]; // MF 或偏移非零
+    if ((packet[9] == 6 || packet[9] == 17) && !fragment && len >= header_len + 4)
+        memcpy(key + 8, packet + header_len, 4);
+    return ~crc32c(~0u, key, sizeof(key));
+}
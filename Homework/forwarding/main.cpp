@@ -3,34 +3,69 @@
 #include <stdlib.h>
 #include <stdio.h>
 
+#define BURST 32
+
 extern bool forward(uint8_t *packet, size_t len);
+extern uint32_t forward_burst(uint8_t *const *packets, const size_t *len, size_t n);
 
 in_addr_t addrs[N_IFACE_ON_BOARD] = {0};
-uint8_t packet[1024];
+uint8_t buffer[BURST][1024];
+uint8_t *packets[BURST];
+size_t lens[BURST];
+
+void output(size_t i) {
+  for (size_t j = 0; j < lens[i]; j++) {
+    printf("%02x", packets[i][j]);
+  }
+  printf("\n");
+}
+
+// 处理收到的一组包，按收到的顺序输出转发后的包
+void flush(size_t n) {
+  uint32_t mask = forward_burst(packets, lens, n);
+  if (mask == (n < 32 ? (1u << n) - 1 : ~0u)) {
+    // 全部通过，不需要逐个判断
+    for (size_t i = 0; i < n; i++) {
+      output(i);
+    }
+    return;
+  }
+  for (size_t i = 0; i < n; i++) {
+    // 没有通过批量检查的包（带选项、TTL 将要超时或者非法）逐个交给 forward
+    if ((mask >> i & 1) || forward(packets[i], lens[i])) {
+      output(i);
+    }
+  }
+}
 
 int main(int argc, char *argv[]) {
   int res = HAL_Init(0, addrs);
   if (res < 0) {
     return res;
   }
+  for (int i = 0; i < BURST; i++) {
+    packets[i] = buffer[i];
+  }
+  size_t n = 0;
   while (1) {
     int mask = (1 << N_IFACE_ON_BOARD) - 1;
     macaddr_t src_mac;
     macaddr_t dst_mac;
     int if_index;
-    res = HAL_ReceiveIPPacket(mask, packet, sizeof(packet), src_mac,
+    res = HAL_ReceiveIPPacket(mask, packets[n], sizeof(buffer[n]), src_mac,
                                   dst_mac, -1, &if_index);
     if (res == HAL_ERR_EOF) {
       break;
     } else if (res < 0) {
+      flush(n);
       return res;
     }
-    if (forward(packet, res)) {
-      for (size_t i = 0; i < res;i++) {
-        printf("%02x", packet[i]);
-      }
-      printf("\n");
+    lens[n++] = res;
+    if (n == BURST) {
+      flush(n);
+      n = 0;
     }
   }
+  flush(n);
   return 0;
-}
\ No newline at end of file
+}
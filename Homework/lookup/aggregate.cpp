@@ -0,0 +1,319 @@
+#include "aggregate.h"
+#include <stdint.h>
+#include <stdlib.h>
+#include <arpa/inet.h>
+
+/*
+  在一棵二叉树上维护 ORTC（Optimal Routing Table Constructor）：
+  树中每个内部节点都恰有两个孩子（缺的一边补一个叶子），叶子的下一跳为从祖先继承的最长前缀的下一跳，没有则为 AGGR_NH_DROP 。
+    第二遍：自底向上为每个节点算出候选集合，叶子为 {自己的下一跳}，内部节点为两个孩子集合的交集，交集为空时取并集；
+    第三遍：自顶向下选择，父节点选中的下一跳在自己的集合中就直接继承（不输出），否则从集合中选一个并输出这个前缀。
+  输出的前缀集合与原来的转发结果相同，且前缀数最少。
+
+  修改一个前缀时，只有它的子树（遇到有自己前缀的节点就停下）和它到根的路径上的集合会变，
+  第三遍也只需要走这些节点，以及父节点的选择变了的节点。每个节点记录上一次的输出，两次输出的差别就是 FIB 要做的改动。
+  节点以编号互相引用，编号 0 表示空，1 号是根。
+*/
+
+#define AGGR_NIL 0
+#define AGGR_ROOT 1
+#define AGGR_NONE 0xFFFF
+
+typedef struct {
+    uint32_t child[2];
+    uint16_t *many;   // set_len 大于 1 时的候选集合，升序
+    uint16_t one;     // set_len 为 1 时的候选集合
+    uint16_t set_len;
+    uint16_t rib_nh;  // 这个前缀在 RIB 中的下一跳编号，不是 RIB 中的前缀则为 AGGR_NONE
+    uint16_t out_nh;  // 输出的下一跳编号，不输出则为 AGGR_NONE
+    uint16_t choice;  // 第三遍为这个节点选中的下一跳（输出的或者继承的）
+    uint8_t dirty;    // 集合被重新计算过，第三遍需要经过它
+} AggrNode;
+
+static AggrNode *nodes = NULL;
+static uint32_t node_cap = 0;
+static uint32_t node_top = AGGR_ROOT + 1; // 0 号不使用
+static uint32_t node_free = AGGR_NIL;     // 回收的节点，通过 child[0] 串起来
+
+static FibOp *ops = NULL;
+static size_t op_cap = 0, op_top = 0;
+static bool op_lost = false; // 有改动因为内存不足没有记下来
+
+static uint16_t merge_buf[2 * FIB_MAX_NEXTHOP];
+
+// 第三遍走到一个节点时，FIB 中覆盖它的次长前缀在改动前后的下一跳编号和长度
+typedef struct {
+    uint32_t old_nh, old_len;
+    uint32_t new_nh, new_len;
+} Cover;
+
+static inline uint32_t bit_at(uint32_t key, uint32_t pos) {
+    return (key >> (31 - pos)) & 1;
+}
+
+static inline bool is_leaf(const AggrNode &n) {
+    return n.child[0] == AGGR_NIL;
+}
+
+static inline const uint16_t *set_of(const AggrNode &n) {
+    return n.set_len == 1 ? &n.one : n.many;
+}
+
+static bool set_has(const AggrNode &n, uint16_t nh) {
+    const uint16_t *s = set_of(n);
+    for (uint32_t i = 0; i < n.set_len && s[i] <= nh; i++)
+        if (s[i] == nh)
+            return true;
+    return false;
+}
+
+/**
+ * @brief 把节点 v 的候选集合设为 s[0..len)
+ *
+ * 内存不足时只保留 s[0] ：集合只影响聚合的效果，只要叶子的集合准确，输出的转发结果就不变。
+ */
+static void set_assign(uint32_t v, const uint16_t *s, uint32_t len) {
+    AggrNode &n = nodes[v];
+    if (len > 1) {
+        uint16_t *m = (uint16_t *) realloc(n.set_len > 1 ? n.many : NULL, len * sizeof(uint16_t));
+        if (m != NULL) {
+            for (uint32_t i = 0; i < len; i++)
+                m[i] = s[i];
+            n.many = m;
+            n.set_len = len;
+            return;
+        }
+    }
+    if (n.set_len > 1)
+        free(n.many);
+    n.many = NULL;
+    n.one = s[0];
+    n.set_len = 1;
+}
+
+// 由两个孩子的集合算出内部节点 v 的集合
+static void combine(uint32_t v) {
+    const AggrNode &a = nodes[nodes[v].child[0]], &b = nodes[nodes[v].child[1]];
+    const uint16_t *sa = set_of(a), *sb = set_of(b);
+    uint32_t i = 0, j = 0, k = 0;
+    while (i < a.set_len && j < b.set_len) {
+        if (sa[i] == sb[j]) {
+            merge_buf[k++] = sa[i];
+            i++;
+            j++;
+        } else if (sa[i] < sb[j]) {
+            i++;
+        } else {
+            j++;
+        }
+    }
+    if (k == 0) {
+        i = j = 0;
+        while (i < a.set_len || j < b.set_len) {
+            if (j == b.set_len || (i < a.set_len && sa[i] < sb[j]))
+                merge_buf[k++] = sa[i++];
+            else if (i == a.set_len || sb[j] < sa[i])
+                merge_buf[k++] = sb[j++];
+            else {
+                merge_buf[k++] = sa[i++];
+                j++;
+            }
+        }
+    }
+    set_assign(v, merge_buf, k);
+    nodes[v].dirty = 1;
+}
+
+/**
+ * @brief 重新计算 v 的子树中依赖于继承的下一跳的集合
+ * @param inh 从 v 的祖先继承的下一跳
+ */
+static void compute_set(uint32_t v, uint16_t inh) {
+    uint16_t h = nodes[v].rib_nh != AGGR_NONE ? nodes[v].rib_nh : inh;
+    if (is_leaf(nodes[v])) {
+        set_assign(v, &h, 1);
+        nodes[v].dirty = 1;
+        return;
+    }
+    for (int b = 0; b < 2; b++) {
+        uint32_t c = nodes[v].child[b];
+        // 有自己前缀的孩子不受继承的下一跳影响
+        if (nodes[c].rib_nh == AGGR_NONE)
+            compute_set(c, h);
+    }
+    combine(v);
+}
+
+static bool init() {
+    nodes = (AggrNode *) malloc(1024 * sizeof(AggrNode));
+    if (nodes == NULL)
+        return false;
+    node_cap = 1024;
+    // 空树：根是一个没有路由的叶子
+    AggrNode &root = nodes[AGGR_ROOT];
+    root.child[0] = root.child[1] = AGGR_NIL;
+    root.many = NULL;
+    root.one = root.choice = AGGR_NH_DROP;
+    root.set_len = 1;
+    root.rib_nh = root.out_nh = AGGR_NONE;
+    root.dirty = 0;
+    return true;
+}
+
+/**
+ * @brief 保证至少还能分配 n 个节点
+ */
+static bool reserve(uint32_t n) {
+    uint32_t avail = node_cap > node_top ? node_cap - node_top : 0;
+    for (uint32_t i = node_free; i != AGGR_NIL && avail < n; i = nodes[i].child[0])
+        avail++;
+    if (avail >= n)
+        return true;
+    uint32_t cap = node_cap * 2;
+    while (cap - node_top < n)
+        cap *= 2;
+    AggrNode *mem = (AggrNode *) realloc(nodes, (size_t) cap * sizeof(AggrNode));
+    if (mem == NULL)
+        return false;
+    nodes = mem;
+    node_cap = cap;
+    return true;
+}
+
+// 新建一个继承 h 、不输出的叶子
+static uint32_t new_leaf(uint16_t h) {
+    uint32_t n;
+    if (node_free != AGGR_NIL) {
+        n = node_free;
+        node_free = nodes[n].child[0];
+    } else {
+        n = node_top++;
+    }
+    AggrNode &node = nodes[n];
+    node.child[0] = node.child[1] = AGGR_NIL;
+    node.many = NULL;
+    node.one = node.choice = h;
+    node.set_len = 1;
+    node.rib_nh = node.out_nh = AGGR_NONE;
+    node.dirty = 0;
+    return n;
+}
+
+static void free_leaf(uint32_t n) {
+    if (nodes[n].set_len > 1)
+        free(nodes[n].many);
+    nodes[n].child[0] = node_free;
+    node_free = n;
+}
+
+static void push_op(uint32_t key, uint32_t len, uint16_t old_nh, uint16_t new_nh, const Cover &cov) {
+    if (op_top == op_cap) {
+        size_t cap = op_cap ? op_cap * 2 : 64;
+        FibOp *mem = (FibOp *) realloc(ops, cap * sizeof(FibOp));
+        if (mem == NULL) {
+            op_lost = true;
+            return;
+        }
+        ops = mem;
+        op_cap = cap;
+    }
+    FibOp &op = ops[op_top++];
+    op.addr = htonl(key);
+    op.len = len;
+    op.old_nh = old_nh == AGGR_NONE ? FIB_NH_NONE : old_nh;
+    op.new_nh = new_nh == AGGR_NONE ? FIB_NH_NONE : new_nh;
+    op.old_cover_nh = cov.old_nh;
+    op.old_cover_len = cov.old_len;
+    op.new_cover_nh = cov.new_nh;
+    op.new_cover_len = cov.new_len;
+}
+
+/**
+ * @brief 第三遍：为 v 的子树重新选择下一跳，输出有变化的前缀
+ * @param pc 父节点现在选中的下一跳
+ * @param old_pc 父节点上一次选中的下一跳
+ * @param cov 覆盖 v 的次长前缀，祖先都在 v 之前经过，所以一边往下走一边更新即可
+ */
+static void choose(uint32_t v, uint16_t pc, uint16_t old_pc, uint32_t key, uint32_t depth, Cover cov) {
+    AggrNode &n = nodes[v];
+    if (!n.dirty && pc == old_pc)
+        return;
+    uint16_t c = set_has(n, pc) ? pc : set_of(n)[0];
+    uint16_t out = c == pc ? AGGR_NONE : c;
+    if (out != n.out_nh)
+        push_op(key, depth, n.out_nh, out, cov);
+    if (n.out_nh != AGGR_NONE) {
+        cov.old_nh = n.out_nh;
+        cov.old_len = depth;
+    }
+    if (out != AGGR_NONE) {
+        cov.new_nh = out;
+        cov.new_len = depth;
+    }
+    uint16_t prev = n.choice;
+    n.choice = c;
+    n.out_nh = out;
+    n.dirty = 0;
+    if (is_leaf(n))
+        return;
+    uint32_t c0 = n.child[0], c1 = n.child[1];
+    choose(c0, c, prev, key, depth + 1, cov);
+    choose(c1, c, prev, key | 1u << (31 - depth), depth + 1, cov);
+    // 两个孩子都是没有前缀的叶子时不再需要它们，它们的集合都和 v 的相同，也都不会被输出
+    if (is_leaf(nodes[c0]) && is_leaf(nodes[c1]) && nodes[c0].rib_nh == AGGR_NONE &&
+        nodes[c1].rib_nh == AGGR_NONE) {
+        free_leaf(c0);
+        free_leaf(c1);
+        nodes[v].child[0] = nodes[v].child[1] = AGGR_NIL;
+    }
+}
+
+/**
+ * @brief 修改树中 key/len 的 RIB 下一跳，并重新计算受影响的集合和输出
+ * @return 修改前的 RIB 下一跳
+ */
+static uint16_t set_rib(uint32_t key, uint32_t len, uint16_t rib_nh) {
+    uint32_t path[33];
+    uint16_t h = AGGR_NH_DROP;
+    path[0] = AGGR_ROOT;
+    for (uint32_t d = 0; d < len; d++) {
+        uint32_t v = path[d];
+        if (nodes[v].rib_nh != AGGR_NONE)
+            h = nodes[v].rib_nh;
+        if (is_leaf(nodes[v])) {
+            uint32_t c0 = new_leaf(h), c1 = new_leaf(h);
+            nodes[v].child[0] = c0;
+            nodes[v].child[1] = c1;
+        }
+        path[d + 1] = nodes[v].child[bit_at(key, d)];
+    }
+    uint16_t old = nodes[path[len]].rib_nh;
+    nodes[path[len]].rib_nh = rib_nh;
+    compute_set(path[len], h);
+    for (uint32_t d = len; d > 0; d--)
+        combine(path[d - 1]);
+    op_top = 0;
+    op_lost = false;
+    Cover none = {FIB_NH_NONE, 0, FIB_NH_NONE, 0};
+    choose(AGGR_ROOT, AGGR_NH_DROP, AGGR_NH_DROP, 0, 0, none);
+    return old;
+}
+
+bool aggr_update(uint32_t addr, uint32_t len, uint32_t nh, const FibOp **out, size_t *n) {
+    if (nodes == NULL && !init())
+        return false;
+    // 路径上每一层最多补两个叶子
+    if (!reserve(2 * len))
+        return false;
+    uint32_t key = ntohl(addr);
+    uint16_t old = set_rib(key, len, nh == FIB_NH_NONE ? AGGR_NONE : nh);
+    if (op_lost) {
+        // 没能记下所有改动，恢复原来的状态，恢复时的改动 FIB 中本来就是那样，不需要记下
+        if (reserve(2 * len))
+            set_rib(key, len, old);
+        return false;
+    }
+    *out = ops;
+    *n = op_top;
+    return true;
+}
@@ -0,0 +1,44 @@
+#ifndef __AGGREGATE_H__
+#define __AGGREGATE_H__
+
+#include "fib.h"
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+  FIB 聚合：把 RIB 中安装到 FIB 的前缀集合换成一个转发结果完全相同、但前缀更少的集合（ORTC 算法），
+  例如下一跳相同的两个相邻 /24 合并成一个 /23 ，被相同下一跳的短前缀覆盖的长前缀直接去掉。
+  聚合后的集合随 RIB 的每次修改增量维护，每次修改给出 FIB 需要做的改动（FibOp 的列表）。
+  编译时加上 -DFIB_AGGREGATE=1（make AGGREGATE=1）启用。
+
+  聚合后可能需要在有路由的前缀下面“挖洞”，这时用保留的下一跳编号 AGGR_NH_DROP 表示没有路由。
+*/
+
+#define AGGR_NH_DROP (FIB_MAX_NEXTHOP - 1)
+
+// 对 FIB 中一个前缀的改动，下一跳编号为 FIB_NH_NONE 表示不在 FIB 中
+typedef struct {
+    uint32_t addr;          // 大端序
+    uint32_t len;
+    uint32_t old_nh;        // 改动前的下一跳编号
+    uint32_t new_nh;        // 改动后的下一跳编号
+    uint32_t old_cover_nh;  // 改动前 FIB 中覆盖它的次长前缀的下一跳编号与长度，撤销删除时使用
+    uint32_t old_cover_len;
+    uint32_t new_cover_nh;  // 改动后 FIB 中覆盖它的次长前缀的下一跳编号与长度，删除时使用
+    uint32_t new_cover_len;
+} FibOp;
+
+/**
+ * @brief 修改 RIB 中一个前缀在 FIB 中的下一跳，并更新聚合后的前缀集合
+ * @param addr 前缀地址，大端序
+ * @param len 前缀长度
+ * @param nh 新的下一跳编号，FIB_NH_NONE 表示从 FIB 中删除
+ * @param ops 写入聚合后的集合需要的改动，指向内部的数组，下一次调用前有效
+ * @param n 写入改动的个数
+ * @return 成功返回 true ，内存不足时返回 false 且不做任何修改
+ *
+ * 按顺序把 ops 应用到 FIB 上即可得到新的集合；按逆序撤销（删除改为插入 old_nh）即可恢复。
+ */
+bool aggr_update(uint32_t addr, uint32_t len, uint32_t nh, const FibOp **ops, size_t *n);
+
+#endif
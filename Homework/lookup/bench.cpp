@@ -0,0 +1,259 @@
+#include "router.h"
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <algorithm>
+#include <vector>
+
+/*
+  转发表的性能测试：建一张给定规模的路由表，然后测量
+  1. 查询：随机地址、均匀落在各个前缀中的地址、按 Zipf 分布集中在少数前缀的地址，分别用 query 和 query_batch；
+  2. 修改：插入、删除、改下一跳混合进行，统计每次 update 的延迟分布；
+  以及转发表占用的内存。
+  不同的引擎编译成不同的程序（make bench 得到 bench_<引擎>），用相同的参数运行即可比较。
+*/
+
+#ifndef FIB_NAME
+#define FIB_NAME "?"
+#endif
+
+#define BENCH_NEXTHOPS 64 // 使用的不同 (nexthop, if_index) 个数
+#define BENCH_BATCH 64    // query_batch 每次查询的地址数
+
+extern void update(bool insert, RoutingTableEntry entry);
+extern bool query(uint32_t addr, uint32_t *nexthop, uint32_t *if_index);
+extern size_t query_batch(const uint32_t *addrs, size_t n, uint32_t *nexthop, uint32_t *if_index, bool *found);
+extern int query_router_entry(uint32_t addr, uint32_t len);
+extern size_t fib_memory_usage();
+extern thread_local uint64_t dcache_hit, dcache_miss;
+extern int p;
+
+// 公网 BGP 表中各前缀长度所占的比例（大致），大部分是 /24 ，比 /24 长的很少
+static const double bgp_weight[33] = {
+    0, 0, 0, 0, 0, 0, 0, 0, 0.0016, 0.0001, 0.0003, 0.0008, 0.0016, 0.0031, 0.0056, 0.0066,
+    0.0139, 0.0086, 0.0148, 0.0282, 0.0256, 0.0418, 0.1161, 0.1040, 0.5914, 0.0020, 0.0020, 0.0020,
+    0.0020, 0.0010, 0.0010, 0.0000, 0.0010};
+
+static double len_cdf[33];
+static uint64_t rng_state = 1;
+
+static inline uint64_t rng() {
+    // xorshift64*
+    rng_state ^= rng_state >> 12;
+    rng_state ^= rng_state << 25;
+    rng_state ^= rng_state >> 27;
+    return rng_state * 2685821657736338717ull;
+}
+
+static inline double rng_double() {
+    return (rng() >> 11) * (1.0 / 9007199254740992.0);
+}
+
+static inline double now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void init_lengths(bool uniform) {
+    double sum = 0;
+    for (int len = 0; len <= 32; len++) {
+        // uniform 时长度在 [8, 32] 中均匀分布，用来测试长前缀多的情况
+        sum += uniform ? (len >= 8 ? 1 : 0) : bgp_weight[len];
+        len_cdf[len] = sum;
+    }
+    for (int len = 0; len <= 32; len++)
+        len_cdf[len] /= sum;
+}
+
+static uint32_t random_length() {
+    double x = rng_double();
+    uint32_t len = 0;
+    while (len < 32 && len_cdf[len] <= x)
+        len++;
+    return len;
+}
+
+static RoutingTableEntry random_route() {
+    RoutingTableEntry entry;
+    memset(&entry, 0, sizeof(entry));
+    entry.len = random_length();
+    uint32_t h = (uint32_t) rng() & (entry.len ? ~0u << (32 - entry.len) : 0);
+    entry.addr = htonl(h);
+    uint32_t k = rng() % BENCH_NEXTHOPS;
+    entry.if_index = k % 4;
+    entry.nexthop = htonl(0x0a000001 | k << 8); // 10.0.k.1
+    return entry;
+}
+
+// 生成一条路由表中还没有的路由
+static RoutingTableEntry fresh_route() {
+    RoutingTableEntry entry;
+    do
+        entry = random_route();
+    while (query_router_entry(entry.addr, entry.len) >= 0);
+    return entry;
+}
+
+// 前缀中随机的一个地址，大端序
+static uint32_t address_in(const RoutingTableEntry &entry) {
+    uint32_t host = entry.len < 32 ? (uint32_t) rng() & ~(entry.len ? ~0u << (32 - entry.len) : 0) : 0;
+    return entry.addr | htonl(host);
+}
+
+static void report_lookup(const char *pattern, const char *api, double ns, size_t n, uint64_t hit, uint64_t miss) {
+    printf("lookup %-10s %-6s %8.2f ns/lookup %8.2f Mlookups/s   dcache hit %5.1f%%\n", pattern, api, ns / n,
+           n / ns * 1e3, hit + miss ? 100.0 * hit / (hit + miss) : 0.0);
+}
+
+/**
+ * @brief 分别用 query 和 query_batch 查询 addrs 中的全部地址，输出平均耗时
+ */
+static void bench_lookup(const char *pattern, const std::vector<uint32_t> &addrs) {
+    uint32_t nexthop[BENCH_BATCH], if_index[BENCH_BATCH];
+    bool found[BENCH_BATCH];
+    uint64_t sink = 0;
+    size_t n = addrs.size();
+
+    // 先查一遍，让两次测量都从缓存已经热身的状态开始
+    for (size_t i = 0; i < n; i++)
+        sink += query(addrs[i], &nexthop[0], &if_index[0]);
+    uint64_t hit = dcache_hit, miss = dcache_miss;
+    double start = now_ns();
+    for (size_t i = 0; i < n; i++)
+        sink += query(addrs[i], &nexthop[0], &if_index[0]);
+    double elapsed = now_ns() - start;
+    report_lookup(pattern, "query", elapsed, n, dcache_hit - hit, dcache_miss - miss);
+
+    hit = dcache_hit, miss = dcache_miss;
+    start = now_ns();
+    for (size_t i = 0; i < n; i += BENCH_BATCH)
+        sink += query_batch(&addrs[i], std::min((size_t) BENCH_BATCH, n - i), nexthop, if_index, found);
+    elapsed = now_ns() - start;
+    report_lookup(pattern, "batch", elapsed, n, dcache_hit - hit, dcache_miss - miss);
+
+    if (sink == 0)
+        printf("(no address matched)\n");
+}
+
+static void usage(const char *name) {
+    fprintf(stderr,
+            "usage: %s [-n prefixes] [-q lookups] [-u updates] [-s zipf_exponent] [-d bgp|uniform] [-r seed]\n"
+            "  -n  routes in the table (default 100000)\n"
+            "  -q  lookups per pattern (default 10000000)\n"
+            "  -u  updates in the churn phase (default 100000)\n"
+            "  -s  exponent of the Zipf popularity of prefixes (default 1.0)\n"
+            "  -d  prefix length distribution: bgp (default) or uniform over /8../32\n"
+            "  -r  random seed (default 1)\n",
+            name);
+}
+
+int main(int argc, char *argv[]) {
+    size_t n_prefix = 100000, n_lookup = 10000000, n_update = 100000;
+    double zipf_s = 1.0;
+    bool uniform = false;
+    int opt;
+    while ((opt = getopt(argc, argv, "n:q:u:s:d:r:h")) != -1) {
+        switch (opt) {
+        case 'n': n_prefix = strtoul(optarg, NULL, 0); break;
+        case 'q': n_lookup = strtoul(optarg, NULL, 0); break;
+        case 'u': n_update = strtoul(optarg, NULL, 0); break;
+        case 's': zipf_s = atof(optarg); break;
+        case 'd': uniform = strcmp(optarg, "uniform") == 0; break;
+        case 'r': rng_state = strtoull(optarg, NULL, 0) | 1; break;
+        default: usage(argv[0]); return 1;
+        }
+    }
+    init_lengths(uniform);
+    printf("engine %s, aggregate %d, %zu prefixes (%s lengths)\n", FIB_NAME, FIB_AGGREGATE, n_prefix,
+           uniform ? "uniform" : "bgp");
+
+    // 建表
+    std::vector<RoutingTableEntry> routes;
+    routes.reserve(n_prefix);
+    double start = now_ns();
+    for (size_t i = 0; i < n_prefix; i++) {
+        RoutingTableEntry entry = fresh_route();
+        update(true, entry);
+        // 转发表空间不足时 update 不会插入这条路由
+        if (query_router_entry(entry.addr, entry.len) >= 0)
+            routes.push_back(entry);
+    }
+    double elapsed = now_ns() - start;
+    size_t rejected = n_prefix - routes.size();
+    printf("build  %zu routes in %.1f ms (%.2f us/route), %zu rejected (FIB full)\n", n_prefix, elapsed / 1e6,
+           n_prefix ? elapsed / 1e3 / n_prefix : 0.0, rejected);
+    printf("memory %.2f MiB FIB (both copies)\n", fib_memory_usage() / 1048576.0);
+
+    // 查询
+    std::vector<uint32_t> addrs(n_lookup);
+    for (size_t i = 0; i < n_lookup; i++)
+        addrs[i] = (uint32_t) rng();
+    bench_lookup("random", addrs);
+    if (routes.empty()) {
+        // 下面按已有的前缀生成查询和修改，没有前缀时无法进行
+        printf("no routes in the table, skipping prefix/zipf lookups and updates\n");
+        return 0;
+    }
+    for (size_t i = 0; i < n_lookup; i++)
+        addrs[i] = address_in(routes[rng() % routes.size()]);
+    bench_lookup("prefix", addrs);
+    // 第 k 受欢迎的前缀被选中的概率正比于 1 / k^s ，排名与前缀的对应是随机的（routes 本身就是随机生成的）
+    std::vector<double> cdf(routes.size());
+    double sum = 0;
+    for (size_t k = 0; k < routes.size(); k++)
+        cdf[k] = sum += pow(k + 1, -zipf_s);
+    for (size_t i = 0; i < n_lookup; i++) {
+        size_t k = std::upper_bound(cdf.begin(), cdf.end(), rng_double() * sum) - cdf.begin();
+        addrs[i] = address_in(routes[std::min(k, routes.size() - 1)]);
+    }
+    char name[32];
+    snprintf(name, sizeof(name), "zipf(%.2g)", zipf_s);
+    bench_lookup(name, addrs);
+
+    // 修改：插入新前缀、删除已有前缀各 40% ，修改已有前缀的下一跳 20% ，路由表规模大致不变
+    std::vector<double> latency(n_update);
+    for (size_t i = 0; i < n_update; i++) {
+        uint32_t x = rng() % 10;
+        if (x < 4 || routes.empty()) {
+            RoutingTableEntry entry = fresh_route();
+            start = now_ns();
+            update(true, entry);
+            latency[i] = now_ns() - start;
+            if (query_router_entry(entry.addr, entry.len) >= 0)
+                routes.push_back(entry);
+        } else if (x < 8) {
+            size_t k = rng() % routes.size();
+            RoutingTableEntry entry = routes[k];
+            routes[k] = routes.back();
+            routes.pop_back();
+            start = now_ns();
+            update(false, entry);
+            latency[i] = now_ns() - start;
+        } else {
+            RoutingTableEntry &entry = routes[rng() % routes.size()];
+            RoutingTableEntry other = random_route();
+            entry.nexthop = other.nexthop;
+            entry.if_index = other.if_index;
+            start = now_ns();
+            update(true, entry);
+            latency[i] = now_ns() - start;
+        }
+    }
+    if (n_update) {
+        std::sort(latency.begin(), latency.end());
+        double total = 0;
+        for (size_t i = 0; i < n_update; i++)
+            total += latency[i];
+        printf("update %zu ops, mean %.2f us, p50 %.2f us, p90 %.2f us, p99 %.2f us, p99.9 %.2f us, max %.2f us\n",
+               n_update, total / n_update / 1e3, latency[n_update / 2] / 1e3, latency[n_update * 9 / 10] / 1e3,
+               latency[n_update * 99 / 100] / 1e3, latency[n_update * 999 / 1000] / 1e3, latency[n_update - 1] / 1e3);
+        printf("memory %.2f MiB FIB (both copies) after churn, %d routes\n", fib_memory_usage() / 1048576.0, p);
+    }
+    return 0;
+}
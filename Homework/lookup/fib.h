@@ -0,0 +1,85 @@
+#ifndef __FIB_H__
+#define __FIB_H__
+
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+  转发表（FIB）引擎的统一接口。
+  FIB 只负责最长前缀匹配：前缀 -> 下一跳编号，下一跳编号对应的具体内容由 lookup.cpp 维护。
+  不同的引擎实现在 fib_<名称>.cpp 中，编译时通过 Makefile 的 FIB 变量选择，例如 make FIB=dir248 。
+  前缀地址与 RoutingTableEntry 一致，以 **大端序** 存储，保证仅最低 len 位可能出现非零。
+  每个 Fib 是一份独立的转发表，引擎不使用全局状态，所以可以同时维护多份（例如双缓冲时一份供查询、一份供修改）。
+  对同一个 Fib 的修改不能和查询同时进行，查询之间可以并发。
+*/
+
+typedef struct Fib Fib;
+
+// 下一跳编号的取值范围为 [0, FIB_MAX_NEXTHOP)
+#define FIB_MAX_NEXTHOP 1023
+// 表示没有匹配的下一跳
+#define FIB_NH_NONE 0xFFFFFFFF
+// 批量查询时同时进行的查询个数
+#define FIB_BATCH 16
+
+/**
+ * @brief 创建一份空的转发表
+ * @return 新的转发表，内存不足时返回 NULL
+ */
+Fib *fib_create();
+
+/**
+ * @brief 释放 fib_create 创建的转发表
+ */
+void fib_destroy(Fib *fib);
+
+/**
+ * @brief 转发表占用的内存
+ * @param fib 转发表
+ * @return 已分配的字节数（包括预留但还没用到的部分）
+ */
+size_t fib_memory(const Fib *fib);
+
+/**
+ * @brief 插入一条前缀，如果已经存在 addr 和 len 都相同的前缀，则替换它的下一跳
+ * @param fib 转发表
+ * @param addr 前缀地址，大端序
+ * @param len 前缀长度
+ * @param nh 下一跳编号
+ * @return 成功返回 true ，转发表空间不足时返回 false 且不做任何修改
+ */
+bool fib_insert(Fib *fib, uint32_t addr, uint32_t len, uint32_t nh);
+
+/**
+ * @brief 删除一条前缀
+ * @param fib 转发表
+ * @param addr 前缀地址，大端序
+ * @param len 前缀长度
+ * @param cover_nh 删除后接替它的前缀（覆盖它的次长前缀）的下一跳编号，没有则为 FIB_NH_NONE
+ * @param cover_len 接替它的前缀的长度
+ * @return 成功（包括前缀本来就不存在）返回 true ，需要重新分配空间的引擎（如 Poptrie）空间不足时返回 false 且不做任何修改
+ *
+ * 需要展开前缀的引擎（如 DIR-24-8）依靠 cover_nh 和 cover_len 回填被删除前缀占用的位置。
+ */
+bool fib_remove(Fib *fib, uint32_t addr, uint32_t len, uint32_t cover_nh, uint32_t cover_len);
+
+/**
+ * @brief 按照最长前缀匹配原则查询
+ * @param fib 转发表
+ * @param addr 需要查询的目标地址，大端序
+ * @return 匹配到的下一跳编号，没有匹配则返回 FIB_NH_NONE
+ */
+uint32_t fib_lookup(const Fib *fib, uint32_t addr);
+
+/**
+ * @brief 批量查询，结果与逐个调用 fib_lookup 相同
+ * @param fib 转发表
+ * @param addrs n 个目标地址，大端序
+ * @param n 地址个数
+ * @param nh 长度为 n 的数组，写入每个地址匹配到的下一跳编号
+ *
+ * 每 FIB_BATCH 个地址交错进行：一个地址等待内存时，先为其他地址预取下一层要访问的位置。
+ */
+void fib_lookup_batch(const Fib *fib, const uint32_t *addrs, size_t n, uint32_t *nh);
+
+#endif
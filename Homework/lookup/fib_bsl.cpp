@@ -0,0 +1,387 @@
+#include "fib.h"
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <arpa/inet.h>
+
+/*
+  按前缀长度二分查找的转发表（Waldvogel 等人的方法）：
+  每个长度 1..32 有一个哈希表，键为 addr & un_mask[len]（大端序，与路由表一致），默认路由单独保存。
+  查询时在长度上二分：在长度 mid 的表中找到了就往更长的方向走，否则往更短的方向走，最多约 5 次哈希查找。
+  为了让二分不错过更长的前缀，每个前缀在二分路径上所有需要“往右走”的长度处放一个标记（marker），
+  标记记录 bmp：长度不超过它的最长匹配前缀，这样往右走之后失败也能直接得到答案。
+
+  插入/删除前缀时，除了维护它本身和它的标记，还要更新比它长的表中被它覆盖的标记的 bmp。
+  哈希表不能按前缀范围枚举，所以另有一棵按位展开的二叉树记录所有带标记的项，从前缀对应的节点往下
+  就能列出它覆盖的标记；遇到更长的前缀时它下面的标记都不受影响，不用再往下走。
+  一次修改的代价是前缀长度加上 bmp 真正改变的标记数，和表的大小无关。
+  插入前先预留好哈希表和二叉树需要的空间，之后的修改不会失败。
+*/
+
+extern uint32_t un_mask[33];
+
+typedef struct {
+    uint32_t key;
+    uint32_t markers;  // 以这一项为标记的更长前缀数
+    uint16_t nh;       // 这一项本身是前缀时为下一跳编号 + 1，否则为 0
+    uint16_t bmp;      // 查到这一项时的最佳匹配的下一跳编号 + 1，0 表示只有默认路由可用
+    uint8_t bmp_len;   // bmp 对应前缀的长度
+    uint8_t used;
+} BslEntry;
+
+typedef struct {
+    BslEntry *slots;
+    uint32_t bits;     // 容量为 2^bits
+    uint32_t size;
+} BslTable;
+
+// 标记索引的节点，深度为 d 的节点对应长度为 d 的前缀
+typedef struct {
+    uint32_t child[2];
+    uint32_t marked;   // 长度 d 的表中对应的项带有标记（markers 不为 0）
+} MarkNode;
+
+struct Fib {
+    BslTable tables[33];
+    uint16_t default_nh; // 默认路由的下一跳编号 + 1
+    MarkNode *mark;      // 0 号不使用，1 号是根；还没有标记时为 NULL
+    uint32_t mark_cap, mark_top, mark_free;
+};
+
+Fib *fib_create() {
+    return (Fib *) calloc(1, sizeof(Fib));
+}
+
+void fib_destroy(Fib *f) {
+    if (f == NULL)
+        return;
+    for (int len = 0; len <= 32; len++)
+        free(f->tables[len].slots);
+    free(f->mark);
+    free(f);
+}
+
+size_t fib_memory(const Fib *f) {
+    size_t bytes = sizeof(Fib);
+    for (int len = 0; len <= 32; len++)
+        if (f->tables[len].bits)
+            bytes += ((size_t) 1 << f->tables[len].bits) * sizeof(BslEntry);
+    return bytes + (size_t) f->mark_cap * sizeof(MarkNode);
+}
+
+static inline uint32_t hash(uint32_t key, uint32_t bits) {
+    return (key * 2654435761u) >> (32 - bits);
+}
+
+static BslEntry *find(const Fib *f, uint32_t len, uint32_t key) {
+    const BslTable &t = f->tables[len];
+    if (t.size == 0)
+        return NULL;
+    uint32_t mask = (1u << t.bits) - 1;
+    for (uint32_t i = hash(key, t.bits);; i = (i + 1) & mask) {
+        if (!t.slots[i].used)
+            return NULL;
+        if (t.slots[i].key == key)
+            return &t.slots[i];
+    }
+}
+
+static BslEntry *place(BslTable &t, uint32_t key) {
+    uint32_t mask = (1u << t.bits) - 1;
+    uint32_t i = hash(key, t.bits);
+    while (t.slots[i].used)
+        i = (i + 1) & mask;
+    memset(&t.slots[i], 0, sizeof(BslEntry));
+    t.slots[i].key = key;
+    t.slots[i].used = 1;
+    t.size++;
+    return &t.slots[i];
+}
+
+/**
+ * @brief 保证长度为 len 的表再放入一项后负载不超过一半，需要时扩容
+ * @return 内存不足时返回 false ，表保持原样
+ */
+static bool reserve(Fib *f, uint32_t len) {
+    BslTable &t = f->tables[len];
+    if (t.bits && (t.size + 1) * 2 <= (1u << t.bits))
+        return true;
+    BslTable old = t;
+    t.bits = old.bits ? old.bits + 1 : 4;
+    t.slots = (BslEntry *) calloc(1u << t.bits, sizeof(BslEntry));
+    if (t.slots == NULL) {
+        t = old;
+        return false;
+    }
+    t.size = 0;
+    for (uint32_t i = 0; old.bits && i < (1u << old.bits); i++)
+        if (old.slots[i].used)
+            *place(t, old.slots[i].key) = old.slots[i];
+    free(old.slots);
+    return true;
+}
+
+// 删除一项，后面的项往回移动以保持线性探测的连续性
+static void erase(Fib *f, uint32_t len, BslEntry *e) {
+    BslTable &t = f->tables[len];
+    uint32_t mask = (1u << t.bits) - 1;
+    uint32_t i = e - t.slots;
+    for (uint32_t j = (i + 1) & mask; t.slots[j].used; j = (j + 1) & mask) {
+        uint32_t k = hash(t.slots[j].key, t.bits);
+        // k 不在 (i, j] 中时 j 可以移到 i
+        if (i <= j ? (k <= i || k > j) : (k <= i && k > j)) {
+            t.slots[i] = t.slots[j];
+            i = j;
+        }
+    }
+    t.slots[i].used = 0;
+    t.size--;
+}
+
+/**
+ * @brief 保证标记索引还能新建 n 个节点
+ * @return 内存不足时返回 false
+ */
+static bool mark_reserve(Fib *f, uint32_t n) {
+    uint32_t top = f->mark_top ? f->mark_top : 2;
+    if (top + n > f->mark_cap) {
+        uint32_t cap = f->mark_cap ? f->mark_cap : 1024;
+        while (cap < top + n)
+            cap *= 2;
+        MarkNode *m = (MarkNode *) realloc(f->mark, (size_t) cap * sizeof(MarkNode));
+        if (m == NULL)
+            return false;
+        f->mark = m;
+        f->mark_cap = cap;
+    }
+    if (f->mark_top == 0) {
+        memset(&f->mark[1], 0, sizeof(MarkNode));
+        f->mark_top = 2;
+    }
+    return true;
+}
+
+// 在标记索引中记下长度为 len 的 key（大端序）带有标记，空间已经由 mark_reserve 预留
+static void mark_add(Fib *f, uint32_t key, uint32_t len) {
+    uint32_t h = ntohl(key), n = 1;
+    for (uint32_t b = 0; b < len; b++) {
+        uint32_t bit = h >> (31 - b) & 1;
+        if (f->mark[n].child[bit] == 0) {
+            uint32_t c;
+            if (f->mark_free) {
+                c = f->mark_free;
+                f->mark_free = f->mark[c].child[0];
+            } else {
+                c = f->mark_top++;
+            }
+            memset(&f->mark[c], 0, sizeof(MarkNode));
+            f->mark[n].child[bit] = c;
+        }
+        n = f->mark[n].child[bit];
+    }
+    f->mark[n].marked = 1;
+}
+
+// 从标记索引中去掉长度为 len 的 key ，并删掉不再需要的节点
+static void mark_del(Fib *f, uint32_t key, uint32_t len) {
+    uint32_t h = ntohl(key), path[33];
+    path[0] = 1;
+    for (uint32_t b = 0; b < len; b++)
+        path[b + 1] = f->mark[path[b]].child[h >> (31 - b) & 1];
+    f->mark[path[len]].marked = 0;
+    for (uint32_t b = len; b > 0; b--) {
+        MarkNode &n = f->mark[path[b]];
+        if (n.marked || n.child[0] || n.child[1])
+            break;
+        f->mark[path[b - 1]].child[h >> (32 - b) & 1] = 0;
+        n.child[0] = f->mark_free;
+        f->mark_free = path[b];
+    }
+}
+
+/**
+ * @brief 二分查找走向长度 len 的过程中，需要在 out 中的各个长度上放标记
+ * @return 标记的个数
+ */
+static uint32_t marker_lengths(uint32_t len, uint32_t *out) {
+    uint32_t n = 0, lo = 1, hi = 32, mid;
+    while ((mid = (lo + hi) / 2) != len) {
+        if (len > mid) {
+            out[n++] = mid;
+            lo = mid + 1;
+        } else {
+            hi = mid - 1;
+        }
+    }
+    return n;
+}
+
+// 长度在 [1, max_len] 之间、覆盖 key 的最长前缀
+static void find_bmp(const Fib *f, uint32_t key, uint32_t max_len, uint16_t *bmp, uint8_t *bmp_len) {
+    for (uint32_t l = max_len; l > 0; l--) {
+        BslEntry *e = find(f, l, key & un_mask[l]);
+        if (e && e->nh) {
+            *bmp = e->nh;
+            *bmp_len = l;
+            return;
+        }
+    }
+    *bmp = 0;
+    *bmp_len = 0;
+}
+
+// 标记索引中节点 n（深度 depth ，前缀为主机序的 h）下面的部分，参数同 refresh_markers
+static void refresh_walk(Fib *f, uint32_t n, uint32_t h, uint32_t depth, uint32_t len, uint16_t bmp, uint8_t bmp_len) {
+    if (depth > len && f->mark[n].marked) {
+        BslEntry *e = find(f, depth, htonl(h));
+        // 被更长的前缀覆盖时，它和它下面的标记都以那个前缀或更长的前缀为 bmp
+        if (e->nh || e->bmp_len > len)
+            return;
+        e->bmp = bmp;
+        e->bmp_len = bmp_len;
+    }
+    for (uint32_t bit = 0; bit < 2 && depth < 32; bit++)
+        if (f->mark[n].child[bit])
+            refresh_walk(f, f->mark[n].child[bit], h | bit << (31 - depth), depth + 1, len, bmp, bmp_len);
+}
+
+/**
+ * @brief 更新比 len 长的表中被 addr/len 覆盖、且 bmp 长度不超过 len 的标记
+ *
+ * 在标记索引中从 addr/len 对应的节点往下走，只访问可能受影响的标记。
+ */
+static void refresh_markers(Fib *f, uint32_t addr, uint32_t len, uint16_t bmp, uint8_t bmp_len) {
+    if (f->mark == NULL)
+        return;
+    uint32_t h = ntohl(addr), n = 1;
+    for (uint32_t b = 0; b < len && n; b++)
+        n = f->mark[n].child[h >> (31 - b) & 1];
+    if (n)
+        refresh_walk(f, n, h, len, len, bmp, bmp_len);
+}
+
+bool fib_insert(Fib *f, uint32_t addr, uint32_t len, uint32_t nh) {
+    if (len == 0) {
+        f->default_nh = nh + 1;
+        return true;
+    }
+    BslEntry *e = find(f, len, addr);
+    uint32_t lens[5];
+    uint32_t n = e == NULL || !e->nh ? marker_lengths(len, lens) : 0; // 已经是前缀时标记都已经放好
+    // 先预留所有可能用到的空间，之后的修改都不会失败
+    if (e == NULL && !reserve(f, len))
+        return false;
+    for (uint32_t i = 0; i < n; i++)
+        if (!reserve(f, lens[i]))
+            return false;
+    if (n && !mark_reserve(f, n * 32)) // 每个标记最多新建 32 个节点
+        return false;
+    if (e == NULL)
+        e = place(f->tables[len], addr);
+    e->nh = e->bmp = nh + 1;
+    e->bmp_len = len;
+    for (uint32_t i = 0; i < n; i++) {
+        uint32_t key = addr & un_mask[lens[i]];
+        BslEntry *m = find(f, lens[i], key);
+        if (m == NULL) {
+            m = place(f->tables[lens[i]], key);
+            find_bmp(f, key, lens[i], &m->bmp, &m->bmp_len);
+        }
+        if (m->markers++ == 0)
+            mark_add(f, key, lens[i]);
+    }
+    refresh_markers(f, addr, len, nh + 1, len);
+    return true;
+}
+
+bool fib_remove(Fib *f, uint32_t addr, uint32_t len, uint32_t cover_nh, uint32_t cover_len) {
+    if (len == 0) {
+        f->default_nh = 0;
+        return true;
+    }
+    BslEntry *e = find(f, len, addr);
+    if (e == NULL || !e->nh)
+        return true;
+    // 接替它的前缀可以直接在更短的表里找到
+    uint16_t bmp;
+    uint8_t bmp_len;
+    find_bmp(f, addr, len - 1, &bmp, &bmp_len);
+    if (e->markers) {
+        e->nh = 0;
+        e->bmp = bmp;
+        e->bmp_len = bmp_len;
+    } else {
+        erase(f, len, e);
+    }
+    uint32_t lens[5];
+    uint32_t n = marker_lengths(len, lens);
+    for (uint32_t i = 0; i < n; i++) {
+        uint32_t key = addr & un_mask[lens[i]];
+        BslEntry *m = find(f, lens[i], key);
+        if (--m->markers == 0) {
+            mark_del(f, key, lens[i]);
+            if (!m->nh)
+                erase(f, lens[i], m);
+        }
+    }
+    refresh_markers(f, addr, len, bmp, bmp_len);
+    return true;
+}
+
+uint32_t fib_lookup(const Fib *f, uint32_t addr) {
+    uint32_t best = f->default_nh;
+    uint32_t lo = 1, hi = 32;
+    while (lo <= hi) {
+        uint32_t mid = (lo + hi) / 2;
+        BslEntry *e = find(f, mid, addr & un_mask[mid]);
+        if (e) {
+            if (e->bmp)
+                best = e->bmp;
+            lo = mid + 1;
+        } else {
+            hi = mid - 1;
+        }
+    }
+    return best - 1; // best 为 0 时正好得到 FIB_NH_NONE
+}
+
+void fib_lookup_batch(const Fib *f, const uint32_t *addrs, size_t n, uint32_t *nh) {
+    uint32_t lo[FIB_BATCH], hi[FIB_BATCH], best[FIB_BATCH];
+    for (size_t base = 0; base < n; base += FIB_BATCH) {
+        size_t m = n - base < FIB_BATCH ? n - base : FIB_BATCH;
+        for (size_t i = 0; i < m; i++) {
+            lo[i] = 1;
+            hi[i] = 32;
+            best[i] = f->default_nh;
+        }
+        // 每轮先为所有地址预取这一轮要探测的位置，再依次探测
+        bool active = true;
+        while (active) {
+            for (size_t i = 0; i < m; i++) {
+                if (lo[i] > hi[i])
+                    continue;
+                uint32_t mid = (lo[i] + hi[i]) / 2;
+                const BslTable &t = f->tables[mid];
+                if (t.size)
+                    __builtin_prefetch(&t.slots[hash(addrs[base + i] & un_mask[mid], t.bits)]);
+            }
+            active = false;
+            for (size_t i = 0; i < m; i++) {
+                if (lo[i] > hi[i])
+                    continue;
+                uint32_t mid = (lo[i] + hi[i]) / 2;
+                BslEntry *e = find(f, mid, addrs[base + i] & un_mask[mid]);
+                if (e) {
+                    if (e->bmp)
+                        best[i] = e->bmp;
+                    lo[i] = mid + 1;
+                } else {
+                    hi[i] = mid - 1;
+                }
+                active |= lo[i] <= hi[i];
+            }
+        }
+        for (size_t i = 0; i < m; i++)
+            nh[base + i] = best[i] - 1;
+    }
+}
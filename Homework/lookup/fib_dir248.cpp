@@ -0,0 +1,193 @@
+#include "fib.h"
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <arpa/inet.h>
+
+/*
+  DIR-24-8 转发表：
+  tbl24 以目标地址（主机序）的高 24 位为下标，共 2^24 项，每项 16 位，约 32 MB，在 fib_create 时分配；
+  长度超过 24 的前缀展开到 tbl8 中，tbl8 按 256 项一块分配，由 tbl24 中的项指向。
+  查询最多访问两次内存。
+
+  每一项的编码：
+    0                         没有路由
+    bit 15 = 1（仅 tbl24）    bit 14..0 为 tbl8 块编号
+    其他                      bit 15..10 为前缀长度，bit 9..0 为下一跳编号 + 1
+  记录前缀长度是为了在插入时不覆盖更长的前缀，在删除时只回填属于被删除前缀的位置。
+*/
+
+#define TBL24_EXT 0x8000
+#define TBL8_MAX_GROUPS 0x8000
+
+#define ENTRY(len, nh) ((uint16_t) ((len) << 10 | ((nh) + 1)))
+#define ENTRY_LEN(e) ((uint32_t) (e) >> 10)
+#define ENTRY_NH(e) ((uint32_t) (e) & 0x3FF)
+
+struct Fib {
+    uint16_t *tbl24;           // 2^24 项，以地址高 24 位为下标
+    uint16_t *tbl8;            // 扩展块，第 g 块为 tbl8[g << 8 .. (g << 8) + 255]
+    uint32_t tbl8_cap;         // 已分配内存的块数
+    uint32_t tbl8_top;         // 使用过的块数
+    uint32_t tbl8_free[TBL8_MAX_GROUPS]; // 回收的块编号
+    uint32_t tbl8_free_top;
+};
+
+Fib *fib_create() {
+    Fib *f = (Fib *) calloc(1, sizeof(Fib));
+    if (f == NULL)
+        return NULL;
+    f->tbl24 = (uint16_t *) calloc(1 << 24, sizeof(uint16_t));
+    if (f->tbl24 == NULL) {
+        free(f);
+        return NULL;
+    }
+    return f;
+}
+
+void fib_destroy(Fib *f) {
+    if (f == NULL)
+        return;
+    free(f->tbl24);
+    free(f->tbl8);
+    free(f);
+}
+
+size_t fib_memory(const Fib *f) {
+    return sizeof(Fib) + ((size_t) 1 << 24) * sizeof(uint16_t) + ((size_t) f->tbl8_cap << 9);
+}
+
+/**
+ * @brief 分配一个 tbl8 块并用 fill 填满
+ * @return 块编号，空间不足时返回 -1
+ */
+static int alloc_group(Fib *f, uint16_t fill) {
+    uint32_t g;
+    if (f->tbl8_free_top > 0) {
+        g = f->tbl8_free[--f->tbl8_free_top];
+    } else {
+        if (f->tbl8_top == TBL8_MAX_GROUPS)
+            return -1;
+        if (f->tbl8_top == f->tbl8_cap) {
+            uint32_t cap = f->tbl8_cap ? f->tbl8_cap * 2 : 64;
+            uint16_t *mem = (uint16_t *) realloc(f->tbl8, (size_t) cap << 9);
+            if (mem == NULL)
+                return -1;
+            f->tbl8 = mem;
+            f->tbl8_cap = cap;
+        }
+        g = f->tbl8_top++;
+    }
+    for (int j = 0; j < 256; j++)
+        f->tbl8[g << 8 | j] = fill;
+    return g;
+}
+
+/**
+ * @brief 如果 tbl24[i] 指向的块内 256 项完全相同，把它收回到 tbl24 中
+ */
+static void try_collapse(Fib *f, uint32_t i) {
+    uint32_t g = f->tbl24[i] & ~TBL24_EXT;
+    uint16_t *group = &f->tbl8[g << 8];
+    for (int j = 1; j < 256; j++)
+        if (group[j] != group[0])
+            return;
+    // 长度超过 24 的前缀最多覆盖 128 项，所以相同的块一定来自长度不超过 24 的前缀
+    f->tbl24[i] = group[0];
+    f->tbl8_free[f->tbl8_free_top++] = g;
+}
+
+bool fib_insert(Fib *f, uint32_t addr, uint32_t len, uint32_t nh) {
+    uint32_t h = ntohl(addr);
+    uint16_t e_new = ENTRY(len, nh);
+    if (len <= 24) {
+        uint32_t start = h >> 8, end = start + (1u << (24 - len));
+        for (uint32_t i = start; i < end; i++) {
+            uint16_t e = f->tbl24[i];
+            if (e & TBL24_EXT) {
+                uint16_t *group = &f->tbl8[(e & ~TBL24_EXT) << 8];
+                for (int j = 0; j < 256; j++)
+                    if (ENTRY_LEN(group[j]) <= len)
+                        group[j] = e_new;
+            } else if (ENTRY_LEN(e) <= len) {
+                f->tbl24[i] = e_new;
+            }
+        }
+    } else {
+        uint32_t i = h >> 8;
+        if (!(f->tbl24[i] & TBL24_EXT)) {
+            int g = alloc_group(f, f->tbl24[i]);
+            if (g < 0)
+                return false;
+            f->tbl24[i] = TBL24_EXT | g;
+        }
+        uint16_t *group = &f->tbl8[(f->tbl24[i] & ~TBL24_EXT) << 8];
+        uint32_t start = h & 0xFF, end = start + (1u << (32 - len));
+        for (uint32_t j = start; j < end; j++)
+            if (ENTRY_LEN(group[j]) <= len)
+                group[j] = e_new;
+    }
+    return true;
+}
+
+bool fib_remove(Fib *f, uint32_t addr, uint32_t len, uint32_t cover_nh, uint32_t cover_len) {
+    uint32_t h = ntohl(addr);
+    uint16_t e_cover = cover_nh == FIB_NH_NONE ? 0 : ENTRY(cover_len, cover_nh);
+    if (len <= 24) {
+        uint32_t start = h >> 8, end = start + (1u << (24 - len));
+        for (uint32_t i = start; i < end; i++) {
+            uint16_t e = f->tbl24[i];
+            if (e & TBL24_EXT) {
+                uint16_t *group = &f->tbl8[(e & ~TBL24_EXT) << 8];
+                for (int j = 0; j < 256; j++)
+                    if (group[j] && ENTRY_LEN(group[j]) == len)
+                        group[j] = e_cover;
+                try_collapse(f, i);
+            } else if (e && ENTRY_LEN(e) == len) {
+                f->tbl24[i] = e_cover;
+            }
+        }
+    } else {
+        uint32_t i = h >> 8;
+        if (!(f->tbl24[i] & TBL24_EXT))
+            return true;
+        uint16_t *group = &f->tbl8[(f->tbl24[i] & ~TBL24_EXT) << 8];
+        uint32_t start = h & 0xFF, end = start + (1u << (32 - len));
+        for (uint32_t j = start; j < end; j++)
+            if (group[j] && ENTRY_LEN(group[j]) == len)
+                group[j] = e_cover;
+        try_collapse(f, i);
+    }
+    return true;
+}
+
+uint32_t fib_lookup(const Fib *f, uint32_t addr) {
+    uint32_t h = ntohl(addr);
+    uint16_t e = f->tbl24[h >> 8];
+    if (e & TBL24_EXT)
+        e = f->tbl8[(uint32_t) (e & ~TBL24_EXT) << 8 | (h & 0xFF)];
+    return ENTRY_NH(e) ? ENTRY_NH(e) - 1 : FIB_NH_NONE;
+}
+
+void fib_lookup_batch(const Fib *f, const uint32_t *addrs, size_t n, uint32_t *nh) {
+    uint32_t h[FIB_BATCH];
+    uint16_t e[FIB_BATCH];
+    for (size_t base = 0; base < n; base += FIB_BATCH) {
+        size_t m = n - base < FIB_BATCH ? n - base : FIB_BATCH;
+        for (size_t i = 0; i < m; i++) {
+            h[i] = ntohl(addrs[base + i]);
+            __builtin_prefetch(&f->tbl24[h[i] >> 8]);
+        }
+        for (size_t i = 0; i < m; i++) {
+            e[i] = f->tbl24[h[i] >> 8];
+            if (e[i] & TBL24_EXT)
+                __builtin_prefetch(&f->tbl8[(uint32_t) (e[i] & ~TBL24_EXT) << 8 | (h[i] & 0xFF)]);
+        }
+        for (size_t i = 0; i < m; i++) {
+            uint16_t x = e[i];
+            if (x & TBL24_EXT)
+                x = f->tbl8[(uint32_t) (x & ~TBL24_EXT) << 8 | (h[i] & 0xFF)];
+            nh[base + i] = ENTRY_NH(x) ? ENTRY_NH(x) - 1 : FIB_NH_NONE;
+        }
+    }
+}
@@ -0,0 +1,414 @@
+#include "fib.h"
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <arpa/inet.h>
+
+/*
+  Poptrie 转发表：步长为 6 的多叉树，每个节点用两个 64 位的位图代替 64 个孩子指针，
+  孩子和叶子在数组中连续存放，用 popcount 算出偏移。
+    vector  第 i 位为 1 表示第 i 个孩子是内部节点，它是 base1 开始的第 popcnt(vector 的 0..i 位) 个节点
+    leafvec 第 i 位为 1 表示从第 i 个孩子开始一段新的叶子，叶子编号同理从 base0 开始
+  相邻且相同的叶子只存一份，一个 24 字节的节点加上几个 2 字节的叶子就能代替一整块展开的表。
+  地址的高 16 位直接索引 dir 表（256 KB），之后最多再经过 3 层节点（16 + 6 + 6 + 4 位）。
+  dir 表中最高位为 1 的项是节点编号，其余的和叶子一样存放下一跳编号 + 1，0 表示没有路由。
+  编译时加上 -mpopcnt（或 -march=native）可以让 __builtin_popcountll 变成一条 popcnt 指令。
+
+  查询结构是从一棵普通的二叉树（控制面）编译出来的：每次插入/删除只重新编译受影响的 dir 项下的子树，
+  新的节点追加在数组末尾，被替换的节点记为垃圾，垃圾超过有效节点数时整体重新编译一次以回收空间。
+  dir 项的新值先写在临时数组里，整个子树都编译成功后才替换；空间不足时丢掉追加的部分，查询结构保持原样，
+  插入和删除都撤销对控制面的修改后返回 false 。
+*/
+
+#define DIR_BITS 16
+#define STRIDE 6
+#define DIR_NODE 0x80000000
+#define CTRL_NIL 0
+
+typedef struct {
+    uint64_t vector;
+    uint64_t leafvec;
+    uint32_t base0; // 叶子数组中的起点
+    uint32_t base1; // 节点数组中的起点
+} PoptrieNode;
+
+// 控制面的二叉树节点，只用于编译
+typedef struct {
+    uint32_t child[2];
+    uint32_t nh;
+} CtrlNode;
+
+struct Fib {
+    uint32_t dir[1 << DIR_BITS];
+    PoptrieNode *nodes;
+    uint32_t node_cap, node_top, node_garbage;
+    uint16_t *leaves;
+    uint32_t leaf_cap, leaf_top, leaf_garbage;
+
+    CtrlNode *ctrl;
+    uint32_t ctrl_cap;
+    uint32_t ctrl_top;  // 0 号不使用，1 号是根
+    uint32_t ctrl_free;
+};
+
+static inline uint32_t bit_at(uint32_t key, uint32_t pos) {
+    return (key >> (31 - pos)) & 1;
+}
+
+// 取出 key 从 pos 开始的 6 位，超出 32 位的部分补 0
+static inline uint32_t chunk_at(uint32_t key, uint32_t pos) {
+    return (uint32_t) (((uint64_t) key << 32) >> (64 - STRIDE - pos)) & ((1 << STRIDE) - 1);
+}
+
+static bool grow(void **mem, uint32_t *cap, uint32_t need, size_t size) {
+    if (need <= *cap)
+        return true;
+    uint32_t c = *cap ? *cap : 1024;
+    while (c < need)
+        c *= 2;
+    void *m = realloc(*mem, (size_t) c * size);
+    if (m == NULL)
+        return false;
+    *mem = m;
+    *cap = c;
+    return true;
+}
+
+Fib *fib_create() {
+    Fib *f = (Fib *) calloc(1, sizeof(Fib));
+    if (f == NULL)
+        return NULL;
+    f->ctrl_top = 2;
+    f->ctrl_free = CTRL_NIL;
+    if (!grow((void **) &f->ctrl, &f->ctrl_cap, f->ctrl_top, sizeof(CtrlNode))) {
+        free(f);
+        return NULL;
+    }
+    f->ctrl[1].child[0] = f->ctrl[1].child[1] = CTRL_NIL;
+    f->ctrl[1].nh = FIB_NH_NONE;
+    return f;
+}
+
+void fib_destroy(Fib *f) {
+    if (f == NULL)
+        return;
+    free(f->nodes);
+    free(f->leaves);
+    free(f->ctrl);
+    free(f);
+}
+
+size_t fib_memory(const Fib *f) {
+    return sizeof(Fib) + (size_t) f->node_cap * sizeof(PoptrieNode) + (size_t) f->leaf_cap * sizeof(uint16_t)
+        + (size_t) f->ctrl_cap * sizeof(CtrlNode);
+}
+
+static uint32_t ctrl_new(Fib *f) {
+    uint32_t n;
+    if (f->ctrl_free != CTRL_NIL) {
+        n = f->ctrl_free;
+        f->ctrl_free = f->ctrl[n].child[0];
+    } else {
+        n = f->ctrl_top++;
+    }
+    f->ctrl[n].child[0] = f->ctrl[n].child[1] = CTRL_NIL;
+    f->ctrl[n].nh = FIB_NH_NONE;
+    return n;
+}
+
+static inline bool ctrl_has_child(const Fib *f, uint32_t n) {
+    return f->ctrl[n].child[0] != CTRL_NIL || f->ctrl[n].child[1] != CTRL_NIL;
+}
+
+/**
+ * @brief 从控制面节点 c（深度 depth，继承的下一跳 inh）编译出第 idx 个 Poptrie 节点
+ */
+static bool build_node(Fib *f, uint32_t idx, uint32_t c, uint32_t depth, uint32_t inh) {
+    uint32_t step = 32 - depth < STRIDE ? 32 - depth : STRIDE;
+    uint32_t child_ctrl[1 << STRIDE], child_inh[1 << STRIDE];
+    uint16_t leaf_nh[1 << STRIDE];
+    uint64_t vector = 0, leafvec = 0;
+    uint32_t n_nodes = 0, n_leaves = 0, last = FIB_NH_NONE;
+    bool first_leaf = true;
+    for (uint32_t v = 0; v < (1u << STRIDE); v++) {
+        // 只有前 step 位有意义，剩下的位在查询时总是 0
+        uint32_t e = c, best = inh;
+        for (uint32_t b = 0; b < step && e != CTRL_NIL; b++) {
+            e = f->ctrl[e].child[(v >> (STRIDE - 1 - b)) & 1];
+            if (e != CTRL_NIL && f->ctrl[e].nh != FIB_NH_NONE)
+                best = f->ctrl[e].nh;
+        }
+        if (e != CTRL_NIL && ctrl_has_child(f, e)) {
+            vector |= 1ULL << v;
+            child_ctrl[n_nodes] = e;
+            child_inh[n_nodes] = best;
+            n_nodes++;
+        } else if (first_leaf || best != last) {
+            leafvec |= 1ULL << v;
+            leaf_nh[n_leaves++] = best + 1;
+            last = best;
+            first_leaf = false;
+        }
+    }
+    if (!grow((void **) &f->nodes, &f->node_cap, f->node_top + n_nodes, sizeof(PoptrieNode)) ||
+        !grow((void **) &f->leaves, &f->leaf_cap, f->leaf_top + n_leaves, sizeof(uint16_t)))
+        return false;
+    uint32_t base1 = f->node_top, base0 = f->leaf_top;
+    f->node_top += n_nodes;
+    f->leaf_top += n_leaves;
+    for (uint32_t i = 0; i < n_leaves; i++)
+        f->leaves[base0 + i] = leaf_nh[i];
+    f->nodes[idx].vector = vector;
+    f->nodes[idx].leafvec = leafvec;
+    f->nodes[idx].base0 = base0;
+    f->nodes[idx].base1 = base1;
+    for (uint32_t i = 0, v = 0; i < n_nodes; v++) {
+        if (!(vector >> v & 1))
+            continue;
+        if (!build_node(f, base1 + i, child_ctrl[i], depth + step, child_inh[i]))
+            return false;
+        i++;
+    }
+    return true;
+}
+
+// 统计 f->dir 项下的节点和叶子数，用于垃圾计数
+static void count_subtree(const Fib *f, uint32_t idx, uint32_t *n_nodes, uint32_t *n_leaves) {
+    const PoptrieNode &node = f->nodes[idx];
+    uint32_t k = __builtin_popcountll(node.vector);
+    *n_nodes += k;
+    *n_leaves += __builtin_popcountll(node.leafvec);
+    for (uint32_t i = 0; i < k; i++)
+        count_subtree(f, node.base1 + i, n_nodes, n_leaves);
+}
+
+// 回收 f->dir 的第 s 项原来的子树
+static void release_slot(Fib *f, uint32_t s) {
+    if (f->dir[s] & DIR_NODE) {
+        uint32_t n_nodes = 1, n_leaves = 0;
+        count_subtree(f, f->dir[s] & ~DIR_NODE, &n_nodes, &n_leaves);
+        f->node_garbage += n_nodes;
+        f->leaf_garbage += n_leaves;
+    }
+}
+
+/**
+ * @brief 编译控制面节点 c（深度 depth，对应 f->dir 下标的前 depth 位为 s）覆盖的所有 f->dir 项
+ * @param best 从根到 c 的父节点为止匹配到的最长前缀的下一跳
+ * @param out f->dir 项的新值写入 out[下标 - base] ，不修改 f->dir
+ */
+static bool compile_walk(Fib *f, uint32_t c, uint32_t depth, uint32_t s, uint32_t best, uint32_t *out, uint32_t base) {
+    if (c != CTRL_NIL && f->ctrl[c].nh != FIB_NH_NONE)
+        best = f->ctrl[c].nh;
+    if (c == CTRL_NIL || (depth == DIR_BITS && !ctrl_has_child(f, c))) {
+        // 整段都是同一个叶子
+        uint32_t start = s << (DIR_BITS - depth), end = start + (1u << (DIR_BITS - depth));
+        for (uint32_t i = start; i < end; i++)
+            out[i - base] = best + 1;
+        return true;
+    }
+    if (depth < DIR_BITS)
+        return compile_walk(f, f->ctrl[c].child[0], depth + 1, s << 1, best, out, base) &&
+               compile_walk(f, f->ctrl[c].child[1], depth + 1, s << 1 | 1, best, out, base);
+    if (!grow((void **) &f->nodes, &f->node_cap, f->node_top + 1, sizeof(PoptrieNode)))
+        return false;
+    uint32_t idx = f->node_top++;
+    if (!build_node(f, idx, c, DIR_BITS, best))
+        return false;
+    out[s - base] = DIR_NODE | idx;
+    return true;
+}
+
+/**
+ * @brief 把控制面节点 c 覆盖的 f->dir 项编译到数组末尾
+ * @return f->dir 中从 s << (DIR_BITS - depth) 开始的各项的新值（由调用者释放），空间不足时返回 NULL 且 f 保持原样
+ */
+static uint32_t *compile_range(Fib *f, uint32_t c, uint32_t depth, uint32_t s, uint32_t best) {
+    uint32_t *out = (uint32_t *) malloc(sizeof(uint32_t) << (DIR_BITS - depth));
+    if (out == NULL)
+        return NULL;
+    uint32_t node_top = f->node_top, leaf_top = f->leaf_top;
+    if (!compile_walk(f, c, depth, s, best, out, s << (DIR_BITS - depth))) {
+        f->node_top = node_top;
+        f->leaf_top = leaf_top;
+        free(out);
+        return NULL;
+    }
+    return out;
+}
+
+// 整体重新编译到新的数组中，回收垃圾；空间不足时保留原来的数组，下一次修改时再试
+static void compact(Fib *f) {
+    PoptrieNode *nodes = f->nodes;
+    uint16_t *leaves = f->leaves;
+    uint32_t node_cap = f->node_cap, node_top = f->node_top, node_garbage = f->node_garbage;
+    uint32_t leaf_cap = f->leaf_cap, leaf_top = f->leaf_top, leaf_garbage = f->leaf_garbage;
+    f->nodes = NULL;
+    f->leaves = NULL;
+    f->node_cap = f->node_top = f->node_garbage = 0;
+    f->leaf_cap = f->leaf_top = f->leaf_garbage = 0;
+    uint32_t *out = compile_range(f, 1, 0, 0, FIB_NH_NONE);
+    if (out == NULL) {
+        free(f->nodes);
+        free(f->leaves);
+        f->nodes = nodes;
+        f->leaves = leaves;
+        f->node_cap = node_cap, f->node_top = node_top, f->node_garbage = node_garbage;
+        f->leaf_cap = leaf_cap, f->leaf_top = leaf_top, f->leaf_garbage = leaf_garbage;
+        return;
+    }
+    memcpy(f->dir, out, sizeof(f->dir));
+    free(out);
+    free(nodes);
+    free(leaves);
+}
+
+/**
+ * @brief 重新编译前缀 key/len 影响到的 f->dir 项
+ * @return 成功返回 true ，空间不足时返回 false 且查询结构保持原样
+ */
+static bool compile_prefix(Fib *f, uint32_t key, uint32_t len) {
+    uint32_t depth = len < DIR_BITS ? len : DIR_BITS;
+    uint32_t c = 1, best = FIB_NH_NONE;
+    for (uint32_t b = 0; b < depth && c != CTRL_NIL; b++) {
+        if (f->ctrl[c].nh != FIB_NH_NONE)
+            best = f->ctrl[c].nh;
+        c = f->ctrl[c].child[bit_at(key, b)];
+    }
+    uint32_t s = depth ? key >> (32 - depth) : 0;
+    uint32_t *out = compile_range(f, c, depth, s, best);
+    if (out == NULL)
+        return false;
+    uint32_t base = s << (DIR_BITS - depth);
+    for (uint32_t i = 0; i < (1u << (DIR_BITS - depth)); i++) {
+        release_slot(f, base + i);
+        f->dir[base + i] = out[i];
+    }
+    free(out);
+    // 垃圾太多时整体重新编译，把数组压缩回有效部分
+    if (f->node_garbage > 1024 && f->node_garbage > f->node_top - f->node_garbage)
+        compact(f);
+    return true;
+}
+
+bool fib_insert(Fib *f, uint32_t addr, uint32_t len, uint32_t nh) {
+    if (!grow((void **) &f->ctrl, &f->ctrl_cap, f->ctrl_top + len, sizeof(CtrlNode)))
+        return false;
+    uint32_t key = ntohl(addr);
+    uint32_t c = 1, fresh = CTRL_NIL, fresh_parent = CTRL_NIL; // 新建的第一个节点和它的父节点
+    for (uint32_t b = 0; b < len; b++) {
+        uint32_t bit = bit_at(key, b);
+        if (f->ctrl[c].child[bit] == CTRL_NIL) {
+            uint32_t n = ctrl_new(f);
+            f->ctrl[c].child[bit] = n;
+            if (fresh == CTRL_NIL) {
+                fresh = n;
+                fresh_parent = c;
+            }
+        }
+        c = f->ctrl[c].child[bit];
+    }
+    uint32_t old_nh = f->ctrl[c].nh;
+    f->ctrl[c].nh = nh;
+    if (compile_prefix(f, key, len))
+        return true;
+    // 空间不足，查询结构没有变：撤销对控制面的修改
+    f->ctrl[c].nh = old_nh;
+    if (fresh != CTRL_NIL) {
+        f->ctrl[fresh_parent].child[f->ctrl[fresh_parent].child[1] == fresh] = CTRL_NIL;
+        // 新建的节点连成一条链，逐个放回空闲链表
+        for (uint32_t n = fresh; n != CTRL_NIL;) {
+            uint32_t next = f->ctrl[n].child[0] != CTRL_NIL ? f->ctrl[n].child[0] : f->ctrl[n].child[1];
+            f->ctrl[n].child[0] = f->ctrl_free;
+            f->ctrl_free = n;
+            n = next;
+        }
+    }
+    return false;
+}
+
+bool fib_remove(Fib *f, uint32_t addr, uint32_t len, uint32_t cover_nh, uint32_t cover_len) {
+    uint32_t key = ntohl(addr);
+    uint32_t path[33];
+    path[0] = 1;
+    for (uint32_t b = 0; b < len; b++) {
+        path[b + 1] = f->ctrl[path[b]].child[bit_at(key, b)];
+        if (path[b + 1] == CTRL_NIL)
+            return true;
+    }
+    uint32_t old_nh = f->ctrl[path[len]].nh;
+    f->ctrl[path[len]].nh = FIB_NH_NONE;
+    // 不再有前缀的节点先只从树上摘下来，path[b + 1..len] 是摘下的节点
+    uint32_t b = len;
+    for (; b > 0 && f->ctrl[path[b]].nh == FIB_NH_NONE && !ctrl_has_child(f, path[b]); b--)
+        f->ctrl[path[b - 1]].child[bit_at(key, b - 1)] = CTRL_NIL;
+    if (!compile_prefix(f, key, len)) {
+        // 空间不足，查询结构没有变：把摘下的节点接回去
+        for (uint32_t i = b + 1; i <= len; i++)
+            f->ctrl[path[i - 1]].child[bit_at(key, i - 1)] = path[i];
+        f->ctrl[path[len]].nh = old_nh;
+        return false;
+    }
+    for (uint32_t i = b + 1; i <= len; i++) {
+        f->ctrl[path[i]].child[0] = f->ctrl_free;
+        f->ctrl_free = path[i];
+    }
+    return true;
+}
+
+uint32_t fib_lookup(const Fib *f, uint32_t addr) {
+    uint32_t key = ntohl(addr);
+    uint32_t e = f->dir[key >> (32 - DIR_BITS)];
+    uint32_t pos = DIR_BITS;
+    while (e & DIR_NODE) {
+        const PoptrieNode &node = f->nodes[e & ~DIR_NODE];
+        uint32_t v = chunk_at(key, pos);
+        uint64_t below = (2ULL << v) - 1; // 第 0..v 位
+        if (node.vector >> v & 1) {
+            e = DIR_NODE | (node.base1 + __builtin_popcountll(node.vector & below) - 1);
+            pos += STRIDE;
+        } else {
+            e = f->leaves[node.base0 + __builtin_popcountll(node.leafvec & below) - 1];
+        }
+    }
+    return e - 1; // e 为 0 时正好得到 FIB_NH_NONE
+}
+
+void fib_lookup_batch(const Fib *f, const uint32_t *addrs, size_t n, uint32_t *nh) {
+    uint32_t key[FIB_BATCH], e[FIB_BATCH], pos[FIB_BATCH];
+    for (size_t base = 0; base < n; base += FIB_BATCH) {
+        size_t m = n - base < FIB_BATCH ? n - base : FIB_BATCH;
+        for (size_t i = 0; i < m; i++) {
+            key[i] = ntohl(addrs[base + i]);
+            pos[i] = DIR_BITS;
+            __builtin_prefetch(&f->dir[key[i] >> (32 - DIR_BITS)]);
+        }
+        for (size_t i = 0; i < m; i++) {
+            e[i] = f->dir[key[i] >> (32 - DIR_BITS)];
+            if (e[i] & DIR_NODE)
+                __builtin_prefetch(&f->nodes[e[i] & ~DIR_NODE]);
+        }
+        // 每轮每个地址往下走一层，并预取下一层的节点或叶子
+        size_t active = m;
+        while (active > 0) {
+            active = 0;
+            for (size_t i = 0; i < m; i++) {
+                if (!(e[i] & DIR_NODE))
+                    continue;
+                const PoptrieNode &node = f->nodes[e[i] & ~DIR_NODE];
+                uint32_t v = chunk_at(key[i], pos[i]);
+                uint64_t below = (2ULL << v) - 1;
+                if (node.vector >> v & 1) {
+                    e[i] = DIR_NODE | (node.base1 + __builtin_popcountll(node.vector & below) - 1);
+                    pos[i] += STRIDE;
+                    __builtin_prefetch(&f->nodes[e[i] & ~DIR_NODE]);
+                    active++;
+                } else {
+                    e[i] = f->leaves[node.base0 + __builtin_popcountll(node.leafvec & below) - 1];
+                }
+            }
+        }
+        for (size_t i = 0; i < m; i++)
+            nh[base + i] = e[i] - 1;
+    }
+}
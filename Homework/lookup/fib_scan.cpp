@@ -0,0 +1,178 @@
+#include "fib.h"
+#include <stdint.h>
+#include <stdlib.h>
+#include <arpa/inet.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define SCAN_X86
+#endif
+
+/*
+  面向小路由表（几百条）的线性扫描转发表。
+  表项按列分开存放（SoA）：每条前缀只占 12 字节，一次可以用 SIMD 指令比较 4 条（SSE4.1）或 8 条（AVX2）。
+  每条前缀预先算好 key = (len + 1) << 16 | nh ，匹配的前缀中 key 最大的就是最长的那个，
+  所以只需要 比较 -> 与 -> 取最大值，没有分支。
+  用哪个版本在第一次创建转发表时根据 CPU 支持的指令集决定，不支持时使用普通的标量版本。
+*/
+
+#define SCAN_ALIGN 8 // 数组长度补齐到 8 的倍数，补上的项 key 为 0 ，永远不会被选中
+
+struct Fib {
+    uint32_t *addr;  // 主机序
+    uint32_t *mask;
+    uint32_t *key;
+    uint32_t size;   // 前缀数
+    uint32_t cap;
+};
+
+static inline uint32_t prefix_mask(uint32_t len) {
+    return len ? ~0u << (32 - len) : 0;
+}
+
+static inline uint32_t padded(uint32_t n) {
+    return (n + SCAN_ALIGN - 1) / SCAN_ALIGN * SCAN_ALIGN;
+}
+
+static uint32_t scan_scalar(const Fib *f, uint32_t h) {
+    uint32_t best = 0;
+    for (uint32_t i = 0; i < padded(f->size); i++) {
+        uint32_t k = (h & f->mask[i]) == f->addr[i] ? f->key[i] : 0;
+        best = k > best ? k : best;
+    }
+    return best;
+}
+
+#ifdef SCAN_X86
+__attribute__((target("sse4.1")))
+static uint32_t scan_sse41(const Fib *f, uint32_t h) {
+    __m128i hv = _mm_set1_epi32(h), best = _mm_setzero_si128();
+    for (uint32_t i = 0; i < padded(f->size); i += 4) {
+        __m128i m = _mm_loadu_si128((const __m128i *) &f->mask[i]);
+        __m128i a = _mm_loadu_si128((const __m128i *) &f->addr[i]);
+        __m128i k = _mm_loadu_si128((const __m128i *) &f->key[i]);
+        __m128i hit = _mm_cmpeq_epi32(_mm_and_si128(hv, m), a);
+        best = _mm_max_epu32(best, _mm_and_si128(hit, k));
+    }
+    best = _mm_max_epu32(best, _mm_shuffle_epi32(best, _MM_SHUFFLE(1, 0, 3, 2)));
+    best = _mm_max_epu32(best, _mm_shuffle_epi32(best, _MM_SHUFFLE(2, 3, 0, 1)));
+    return _mm_cvtsi128_si32(best);
+}
+
+__attribute__((target("avx2")))
+static uint32_t scan_avx2(const Fib *f, uint32_t h) {
+    __m256i hv = _mm256_set1_epi32(h), best = _mm256_setzero_si256();
+    for (uint32_t i = 0; i < padded(f->size); i += 8) {
+        __m256i m = _mm256_loadu_si256((const __m256i *) &f->mask[i]);
+        __m256i a = _mm256_loadu_si256((const __m256i *) &f->addr[i]);
+        __m256i k = _mm256_loadu_si256((const __m256i *) &f->key[i]);
+        __m256i hit = _mm256_cmpeq_epi32(_mm256_and_si256(hv, m), a);
+        best = _mm256_max_epu32(best, _mm256_and_si256(hit, k));
+    }
+    __m128i b = _mm_max_epu32(_mm256_castsi256_si128(best), _mm256_extracti128_si256(best, 1));
+    b = _mm_max_epu32(b, _mm_shuffle_epi32(b, _MM_SHUFFLE(1, 0, 3, 2)));
+    b = _mm_max_epu32(b, _mm_shuffle_epi32(b, _MM_SHUFFLE(2, 3, 0, 1)));
+    return _mm_cvtsi128_si32(b);
+}
+#endif
+
+static uint32_t (*scan)(const Fib *f, uint32_t h) = NULL;
+
+// 根据 CPU 支持的指令集选择扫描的实现，在 fib_create 中调用，之后只读。
+// 不放到第一次查询时再选，否则多个读者线程会同时写 scan
+static void select_scan() {
+    scan = scan_scalar;
+#ifdef SCAN_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        scan = scan_avx2;
+    else if (__builtin_cpu_supports("sse4.1"))
+        scan = scan_sse41;
+#endif
+}
+
+Fib *fib_create() {
+    if (scan == NULL)
+        select_scan();
+    return (Fib *) calloc(1, sizeof(Fib));
+}
+
+void fib_destroy(Fib *f) {
+    if (f == NULL)
+        return;
+    free(f->addr);
+    free(f->mask);
+    free(f->key);
+    free(f);
+}
+
+size_t fib_memory(const Fib *f) {
+    return sizeof(Fib) + (size_t) f->cap * 3 * sizeof(uint32_t);
+}
+
+static bool grow(Fib *f, uint32_t need) {
+    if (need <= f->cap)
+        return true;
+    uint32_t cap = f->cap ? f->cap * 2 : 64;
+    while (cap < need)
+        cap *= 2;
+    uint32_t *a = (uint32_t *) realloc(f->addr, cap * sizeof(uint32_t));
+    if (a == NULL)
+        return false;
+    f->addr = a;
+    uint32_t *m = (uint32_t *) realloc(f->mask, cap * sizeof(uint32_t));
+    if (m == NULL)
+        return false;
+    f->mask = m;
+    uint32_t *k = (uint32_t *) realloc(f->key, cap * sizeof(uint32_t));
+    if (k == NULL)
+        return false;
+    f->key = k;
+    for (uint32_t i = f->cap; i < cap; i++)
+        f->addr[i] = f->mask[i] = f->key[i] = 0;
+    f->cap = cap;
+    return true;
+}
+
+static int find(const Fib *f, uint32_t h, uint32_t len) {
+    for (uint32_t i = 0; i < f->size; i++)
+        if (f->addr[i] == h && f->key[i] >> 16 == len + 1)
+            return i;
+    return -1;
+}
+
+bool fib_insert(Fib *f, uint32_t addr, uint32_t len, uint32_t nh) {
+    uint32_t h = ntohl(addr);
+    int i = find(f, h, len);
+    if (i < 0) {
+        if (!grow(f, padded(f->size + 1)))
+            return false;
+        i = f->size++;
+        f->addr[i] = h;
+        f->mask[i] = prefix_mask(len);
+    }
+    f->key[i] = (len + 1) << 16 | nh;
+    return true;
+}
+
+bool fib_remove(Fib *f, uint32_t addr, uint32_t len, uint32_t cover_nh, uint32_t cover_len) {
+    int i = find(f, ntohl(addr), len);
+    if (i < 0)
+        return true;
+    uint32_t last = --f->size;
+    f->addr[i] = f->addr[last];
+    f->mask[i] = f->mask[last];
+    f->key[i] = f->key[last];
+    f->addr[last] = f->mask[last] = f->key[last] = 0;
+    return true;
+}
+
+uint32_t fib_lookup(const Fib *f, uint32_t addr) {
+    uint32_t best = scan(f, ntohl(addr));
+    return best ? best & 0xFFFF : FIB_NH_NONE;
+}
+
+void fib_lookup_batch(const Fib *f, const uint32_t *addrs, size_t n, uint32_t *nh) {
+    // 表本身就在缓存里，逐个扫描即可
+    for (size_t i = 0; i < n; i++)
+        nh[i] = fib_lookup(f, addrs[i]);
+}
@@ -0,0 +1,246 @@
+#include "fib.h"
+#include <stdint.h>
+#include <stdlib.h>
+#include <arpa/inet.h>
+
+/*
+  路径压缩（Patricia）前缀树转发表，内存随前缀数增长，适合内存较小的设备。
+  根部做一次 16 位的层压缩：长度不小于 16 的前缀按地址高 16 位分到 2^16 棵子树中（根表 256 KB），
+  长度小于 16 的前缀放在单独的一棵树里，只有在子树中没有匹配时才查询。
+  每个节点 16 字节，一个缓存行放 4 个节点；树中只有前缀节点和分叉节点，节点数不超过前缀数的两倍。
+  节点以编号互相引用，编号 0 表示空。
+*/
+
+#define TRIE_ROOT_BITS 16
+#define TRIE_NIL 0
+#define TRIE_NH_NONE 0xFFFF
+
+typedef struct {
+    uint32_t key;      // 主机序，仅高 len 位有效
+    uint32_t child[2];
+    uint16_t nh;       // 下一跳编号，TRIE_NH_NONE 表示只是分叉节点
+    uint8_t len;
+} TrieNode;
+
+struct Fib {
+    uint32_t roots[1 << TRIE_ROOT_BITS]; // 长度不小于 16 的前缀
+    uint32_t short_root;  // 长度小于 16 的前缀
+    TrieNode *pool;
+    uint32_t pool_cap;
+    uint32_t pool_top;    // 0 号节点不使用
+    uint32_t free_list;   // 回收的节点，通过 child[0] 串起来
+};
+
+Fib *fib_create() {
+    Fib *f = (Fib *) calloc(1, sizeof(Fib));
+    if (f == NULL)
+        return NULL;
+    f->short_root = f->free_list = TRIE_NIL;
+    f->pool_top = 1;
+    return f;
+}
+
+void fib_destroy(Fib *f) {
+    if (f == NULL)
+        return;
+    free(f->pool);
+    free(f);
+}
+
+size_t fib_memory(const Fib *f) {
+    return sizeof(Fib) + (size_t) f->pool_cap * sizeof(TrieNode);
+}
+
+static inline uint32_t prefix_mask(uint32_t len) {
+    return len ? ~0u << (32 - len) : 0;
+}
+
+static inline uint32_t bit_at(uint32_t key, uint32_t pos) {
+    return (key >> (31 - pos)) & 1;
+}
+
+/**
+ * @brief 保证至少还能分配 n 个节点，分配过程中 pool 可能被移动，所以修改前先调用
+ */
+static bool reserve(Fib *f, uint32_t n) {
+    uint32_t avail = f->pool_cap > f->pool_top ? f->pool_cap - f->pool_top : 0;
+    for (uint32_t i = f->free_list; i != TRIE_NIL && avail < n; i = f->pool[i].child[0])
+        avail++;
+    if (avail >= n)
+        return true;
+    uint32_t cap = f->pool_cap ? f->pool_cap * 2 : 1024;
+    while (cap - f->pool_top < n)
+        cap *= 2;
+    TrieNode *mem = (TrieNode *) realloc(f->pool, (size_t) cap * sizeof(TrieNode));
+    if (mem == NULL)
+        return false;
+    f->pool = mem;
+    f->pool_cap = cap;
+    return true;
+}
+
+static uint32_t new_node(Fib *f, uint32_t key, uint32_t len, uint32_t nh) {
+    uint32_t n;
+    if (f->free_list != TRIE_NIL) {
+        n = f->free_list;
+        f->free_list = f->pool[n].child[0];
+    } else {
+        n = f->pool_top++;
+    }
+    f->pool[n].key = key;
+    f->pool[n].len = len;
+    f->pool[n].nh = nh;
+    f->pool[n].child[0] = f->pool[n].child[1] = TRIE_NIL;
+    return n;
+}
+
+static void free_node(Fib *f, uint32_t n) {
+    f->pool[n].child[0] = f->free_list;
+    f->free_list = n;
+}
+
+static uint32_t *root_of(Fib *f, uint32_t key, uint32_t len) {
+    return len < TRIE_ROOT_BITS ? &f->short_root : &f->roots[key >> (32 - TRIE_ROOT_BITS)];
+}
+
+bool fib_insert(Fib *f, uint32_t addr, uint32_t len, uint32_t nh) {
+    if (!reserve(f, 2))
+        return false;
+    uint32_t key = ntohl(addr);
+    uint32_t *link = root_of(f, key, len);
+    while (true) {
+        uint32_t n = *link;
+        if (n == TRIE_NIL) {
+            *link = new_node(f, key, len, nh);
+            return true;
+        }
+        TrieNode &node = f->pool[n];
+        uint32_t diff = key ^ node.key;
+        uint32_t common = diff ? __builtin_clz(diff) : 32;
+        if (common > len)
+            common = len;
+        if (common > node.len)
+            common = node.len;
+        if (common == node.len) {
+            if (node.len == len) {
+                node.nh = nh;
+                return true;
+            }
+            link = &node.child[bit_at(key, node.len)];
+            continue;
+        }
+        if (common == len) {
+            // 新前缀是 node 的祖先
+            uint32_t m = new_node(f, key, len, nh);
+            f->pool[m].child[bit_at(f->pool[n].key, len)] = n;
+            *link = m;
+        } else {
+            // 在 common 处分叉
+            uint32_t fork = new_node(f, key & prefix_mask(common), common, TRIE_NH_NONE);
+            uint32_t leaf = new_node(f, key, len, nh);
+            f->pool[fork].child[bit_at(key, common)] = leaf;
+            f->pool[fork].child[bit_at(f->pool[n].key, common)] = n;
+            *link = fork;
+        }
+        return true;
+    }
+}
+
+bool fib_remove(Fib *f, uint32_t addr, uint32_t len, uint32_t cover_nh, uint32_t cover_len) {
+    uint32_t key = ntohl(addr);
+    uint32_t *parent_link = NULL;
+    uint32_t *link = root_of(f, key, len);
+    while (*link != TRIE_NIL) {
+        TrieNode &node = f->pool[*link];
+        if (node.len > len || ((key ^ node.key) & prefix_mask(node.len)))
+            return true;
+        if (node.len == len)
+            break;
+        parent_link = link;
+        link = &node.child[bit_at(key, node.len)];
+    }
+    uint32_t n = *link;
+    if (n == TRIE_NIL || f->pool[n].nh == TRIE_NH_NONE)
+        return true;
+    f->pool[n].nh = TRIE_NH_NONE;
+    // 去掉不再需要的节点：没有孩子的节点直接删除，只有一个孩子的分叉节点用孩子代替
+    if (f->pool[n].child[0] != TRIE_NIL && f->pool[n].child[1] != TRIE_NIL)
+        return true;
+    *link = f->pool[n].child[0] != TRIE_NIL ? f->pool[n].child[0] : f->pool[n].child[1];
+    free_node(f, n);
+    if (*link != TRIE_NIL || parent_link == NULL)
+        return true;
+    uint32_t parent = *parent_link;
+    if (f->pool[parent].nh != TRIE_NH_NONE)
+        return true;
+    *parent_link = f->pool[parent].child[0] != TRIE_NIL ? f->pool[parent].child[0] : f->pool[parent].child[1];
+    free_node(f, parent);
+    return true;
+}
+
+static inline uint32_t trie_lookup(const Fib *f, uint32_t n, uint32_t key) {
+    uint32_t best = FIB_NH_NONE;
+    while (n != TRIE_NIL) {
+        const TrieNode &node = f->pool[n];
+        if ((key ^ node.key) & prefix_mask(node.len))
+            break;
+        if (node.nh != TRIE_NH_NONE)
+            best = node.nh;
+        if (node.len == 32)
+            break;
+        n = node.child[bit_at(key, node.len)];
+    }
+    return best;
+}
+
+uint32_t fib_lookup(const Fib *f, uint32_t addr) {
+    uint32_t key = ntohl(addr);
+    uint32_t nh = trie_lookup(f, f->roots[key >> (32 - TRIE_ROOT_BITS)], key);
+    if (nh == FIB_NH_NONE)
+        nh = trie_lookup(f, f->short_root, key);
+    return nh;
+}
+
+void fib_lookup_batch(const Fib *f, const uint32_t *addrs, size_t n, uint32_t *nh) {
+    uint32_t key[FIB_BATCH], node[FIB_BATCH], best[FIB_BATCH];
+    bool in_short[FIB_BATCH];
+    for (size_t base = 0; base < n; base += FIB_BATCH) {
+        size_t m = n - base < FIB_BATCH ? n - base : FIB_BATCH;
+        for (size_t i = 0; i < m; i++) {
+            key[i] = ntohl(addrs[base + i]);
+            node[i] = f->roots[key[i] >> (32 - TRIE_ROOT_BITS)];
+            best[i] = FIB_NH_NONE;
+            in_short[i] = false;
+            __builtin_prefetch(&f->pool[node[i]]);
+        }
+        // 每轮每个地址往下走一层，并预取下一层的节点
+        size_t active = m;
+        while (active > 0) {
+            active = 0;
+            for (size_t i = 0; i < m; i++) {
+                uint32_t c = node[i];
+                if (c != TRIE_NIL) {
+                    const TrieNode &t = f->pool[c];
+                    if ((key[i] ^ t.key) & prefix_mask(t.len)) {
+                        c = TRIE_NIL;
+                    } else {
+                        if (t.nh != TRIE_NH_NONE)
+                            best[i] = t.nh;
+                        c = t.len == 32 ? TRIE_NIL : t.child[bit_at(key[i], t.len)];
+                    }
+                }
+                if (c == TRIE_NIL && !in_short[i] && best[i] == FIB_NH_NONE) {
+                    in_short[i] = true;
+                    c = f->short_root;
+                }
+                node[i] = c;
+                if (c != TRIE_NIL) {
+                    __builtin_prefetch(&f->pool[c]);
+                    active++;
+                }
+            }
+        }
+        for (size_t i = 0; i < m; i++)
+            nh[base + i] = best[i];
+    }
+}
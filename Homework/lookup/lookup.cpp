@@ -1,6 +1,9 @@
 #include "router.h"
+#include "fib.h"
+#include "aggregate.h"
 #include <stdint.h>
 #include <stdlib.h>
+#include <sched.h>
 #include <arpa/inet.h>
 
 /*
@@ -19,8 +22,29 @@
   你可以在全局变量中把路由表以一定的数据结构格式保存下来。
 */
 
-RoutingTableEntry tableEntry[10000];
+/*
+  路由表分为两层：
+  RIB（tableEntry 和 tableInfo）保存 RIP 需要的全部信息（metric 、来源等），只有控制面访问；
+  FIB 只保存 前缀 -> 下一跳编号，下一跳表只保存转发需要的 (nexthop, if_index) 。
+  metric 达到 RIP_INFINITY 的路由不可达，只留在 RIB 中用于通告，不进入 FIB 。
+  只改变 metric 或来源、不改变转发结果的更新不会修改 FIB ，也不会使目的地址缓存失效。
+
+  RIB 连续存放在 tableEntry（常用字段）和 tableInfo（nexthop 、from）中，满了就把容量加倍，删除时用最后一项填补空位。
+  tableEntry 中同时记录每条路由在 FIB 中的下一跳编号，找覆盖前缀等操作只需要读 tableEntry 。
+  另有一个以 (addr, len) 为键的开放寻址哈希索引，存放表项序号，插入、替换、删除都只需要常数次探测。
+  tableVersion 按 ROUTE_CHUNK_SIZE 项分块记录修改次数，表项 i 改变时第 i / ROUTE_CHUNK_SIZE 块的计数加一，
+  生成 RIP 通告的一方记下生成时的计数，只需要重新生成计数变了的块。
+*/
+RouteEntry *tableEntry = NULL;
+RouteInfo *tableInfo = NULL;
+uint32_t *tableVersion = NULL;
 int p = 0;  // 表尾+1
+static int table_cap = 0;
+
+#define INDEX_EMPTY -1
+
+static int *route_index = NULL; // 哈希索引，容量为 2^index_bits ，负载不超过一半
+static uint32_t index_bits = 0;
 uint32_t un_mask[33] = {0x00000000,
                   0x00000080, 0x000000c0, 0x000000e0, 0x000000f0,
                   0x000000f8, 0x000000fc, 0x000000fe, 0x000000ff,
@@ -31,29 +55,633 @@ uint32_t un_mask[33] = {0x00000000,
                   0x80ffffff, 0xc0ffffff, 0xe0ffffff, 0xf0ffffff,
                   0xf8ffffff, 0xfcffffff, 0xfeffffff, 0xffffffff};
 
+/*
+  下一跳表：FIB 中只保存编号，路径相同的表项共用一项。
+  一项是一组等价路径（ECMP），通常只有一条；有多条时按流的哈希值选择，同一个流总是走同一条路径。
+  第一条路径同时记录在 RIB 中（tableEntry 的 if_index 和 tableInfo 的 nexthop），其余的只在这里。
+*/
+typedef struct {
+    uint32_t nexthop;
+    uint32_t if_index;
+} NextHopPath;
+
+typedef struct {
+    uint32_t n; // 路径数
+    NextHopPath path[ECMP_MAX_PATHS];
+} NextHopEntry;
+
+#if FIB_AGGREGATE
+#define NH_LIMIT AGGR_NH_DROP // 聚合时保留最后一个编号表示没有路由
+#else
+#define NH_LIMIT FIB_MAX_NEXTHOP
+#endif
+
+NextHopEntry nextHop[FIB_MAX_NEXTHOP];
+static uint32_t nextHopRef[FIB_MAX_NEXTHOP]; // 引用计数，为 0 表示空闲；查询不需要，所以和 nextHop 分开存放
+uint32_t nh_top = 0; // 使用过的下一跳编号数
+
+/*
+  双缓冲（RCU）的 FIB：两份内容相同的转发表，查询只读 fib_active 指向的那一份。
+  修改时先改另一份，原子地切换 fib_active ，等所有可能还在读旧的那份的查询结束后，再对旧的那份做同样的修改。
+  查询不加锁，也不会看到修改了一半的表，所以转发可以放在别的线程里进行，update 只能在一个线程中调用。
+  查询只访问 FIB 、下一跳表和自己线程的目的地址缓存，路由表 tableEntry 只有调用 update 的线程访问。
+
+  回收基于代数（epoch）：fib_gen 在每次切换后加一。
+  每个查询线程有一个槽位，查询期间记录开始时读到的 fib_gen ，不在查询中时为 0 。线程退出时归还槽位，给之后的线程使用。
+  同时存在的查询线程超过 RCU_MAX_READERS 个时，多出来的线程共用一个槽位，按代数的奇偶分别计数正在进行的查询。
+  切换后等到每个槽位都为 0 或不小于新的代数、且上一代的计数为 0 ，就没有查询还在读旧的那份了；
+  被删掉的下一跳也要等到这之后才释放，以免编号被重用时查询读到别的下一跳。
+*/
+#define RCU_MAX_READERS 64 // 独占槽位的查询线程数
+#define RCU_SHARED RCU_MAX_READERS // reader_id 为此值表示使用共用的槽位
+
+typedef struct {
+    alignas(64) uint64_t gen; // 每个槽位独占一个缓存行
+    uint32_t owned;           // 是否已经分配给某个线程
+} ReaderSlot;
+
+// 线程退出时归还它的槽位
+struct ReaderRelease {
+    ~ReaderRelease();
+};
+
+static Fib *fib[2] = {fib_create(), fib_create()};
+static int fib_cur = 0; // fib_active 在 fib 中的下标，只有 update 使用
+static Fib *fib_active = fib[0] && fib[1] ? fib[0] : NULL; // 有一份没能创建时为 NULL ，查询都查不到，修改都失败
+static uint64_t fib_gen = 1;
+static ReaderSlot readers[RCU_MAX_READERS];
+alignas(64) static uint64_t shared_readers[2]; // 共用槽位中按代数奇偶计数的查询数
+static thread_local int reader_id = -1;
+static thread_local ReaderRelease reader_release;
+
+ReaderRelease::~ReaderRelease() {
+    if (reader_id >= 0 && reader_id < RCU_MAX_READERS)
+        __atomic_store_n(&readers[reader_id].owned, 0, __ATOMIC_RELEASE);
+}
+
+// 为当前线程分配一个槽位，都被占用时使用共用的槽位
+static int reader_claim() {
+    (void) &reader_release; // 使用它才会在线程退出时析构
+    for (int i = 0; i < RCU_MAX_READERS; i++) {
+        uint32_t expected = 0;
+        if (__atomic_compare_exchange_n(&readers[i].owned, &expected, 1, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+            return i;
+    }
+    return RCU_SHARED;
+}
+
+/**
+ * @brief 开始一次查询，之后可以读取返回的 FIB 和下一跳表，直到调用 read_unlock
+ * @param gen 写入查询开始时的代数，用于目的地址缓存
+ * @return 当前的 FIB
+ */
+static inline const Fib *read_lock(uint64_t *gen) {
+    if (reader_id < 0)
+        reader_id = reader_claim();
+    if (reader_id != RCU_SHARED) {
+        *gen = __atomic_load_n(&fib_gen, __ATOMIC_SEQ_CST);
+        __atomic_store_n(&readers[reader_id].gen, *gen, __ATOMIC_SEQ_CST);
+    } else {
+        // 计数之后代数变了的话，切换的一方可能没有看到这次计数，重来
+        for (;;) {
+            *gen = __atomic_load_n(&fib_gen, __ATOMIC_SEQ_CST);
+            __atomic_add_fetch(&shared_readers[*gen & 1], 1, __ATOMIC_SEQ_CST);
+            if (__atomic_load_n(&fib_gen, __ATOMIC_SEQ_CST) == *gen)
+                break;
+            __atomic_sub_fetch(&shared_readers[*gen & 1], 1, __ATOMIC_RELEASE);
+        }
+    }
+    return __atomic_load_n(&fib_active, __ATOMIC_SEQ_CST);
+}
+
+/**
+ * @brief 结束一次查询
+ * @param gen read_lock 写入的代数
+ */
+static inline void read_unlock(uint64_t gen) {
+    if (reader_id != RCU_SHARED)
+        __atomic_store_n(&readers[reader_id].gen, 0, __ATOMIC_RELEASE);
+    else
+        __atomic_sub_fetch(&shared_readers[gen & 1], 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * @brief 切换到另一份 FIB ，返回时已经没有查询在读原来那份，可以修改它
+ */
+static void fib_publish() {
+    fib_cur ^= 1;
+    __atomic_store_n(&fib_active, fib[fib_cur], __ATOMIC_SEQ_CST);
+    uint64_t gen = __atomic_add_fetch(&fib_gen, 1, __ATOMIC_SEQ_CST);
+    for (int i = 0; i < RCU_MAX_READERS; i++) {
+        uint64_t g;
+        while ((g = __atomic_load_n(&readers[i].gen, __ATOMIC_SEQ_CST)) != 0 && g < gen)
+            sched_yield();
+    }
+    while (__atomic_load_n(&shared_readers[(gen - 1) & 1], __ATOMIC_SEQ_CST) != 0)
+        sched_yield();
+}
+
+// 目的地址缓存：目的地址 -> 下一跳编号，组相联，每个线程一份，查询时先查缓存再做最长前缀匹配
+#define DCACHE_SET_BITS 10
+#define DCACHE_WAYS 4
+
+typedef struct {
+    uint32_t addr;
+    uint32_t nh;
+    uint64_t gen; // 写入时的 fib_gen ，和当前的不同就是失效的
+} DCacheEntry;
+
+alignas(64) static thread_local DCacheEntry dcache[1 << DCACHE_SET_BITS][DCACHE_WAYS]; // 每组一个缓存行
+static thread_local uint8_t dcache_victim[1 << DCACHE_SET_BITS]; // 每组下一个被替换的位置
+thread_local uint64_t dcache_hit = 0, dcache_miss = 0; // 本线程命中/未命中次数，用于调整缓存大小
+
+static inline uint32_t dcache_index(uint32_t addr) {
+    return (addr * 2654435761u) >> (32 - DCACHE_SET_BITS);
+}
+
+/**
+ * @brief 在缓存中查找目的地址
+ * @param gen 当前的代数
+ * @return 命中则返回 true 并把下一跳编号写入 *nh
+ */
+static inline bool dcache_find(uint32_t addr, uint64_t gen, uint32_t *nh) {
+    DCacheEntry *set = dcache[dcache_index(addr)];
+    for (int w = 0; w < DCACHE_WAYS; w++) {
+        if (set[w].gen == gen && set[w].addr == addr) {
+            *nh = set[w].nh;
+            dcache_hit++;
+            return true;
+        }
+    }
+    dcache_miss++;
+    return false;
+}
+
+static void dcache_fill(uint32_t addr, uint64_t gen, uint32_t nh) {
+    uint32_t idx = dcache_index(addr);
+    DCacheEntry *set = dcache[idx];
+    int w = 0;
+    while (w < DCACHE_WAYS && set[w].gen == gen)
+        w++;
+    if (w == DCACHE_WAYS) {
+        // 没有失效的项时轮流替换
+        w = dcache_victim[idx];
+        dcache_victim[idx] = (w + 1) % DCACHE_WAYS;
+    }
+    set[w].addr = addr;
+    set[w].nh = nh;
+    set[w].gen = gen;
+}
+
+static bool same_paths(const NextHopEntry &e, const NextHopPath *paths, uint32_t n) {
+    if (e.n != n)
+        return false;
+    for (uint32_t k = 0; k < n; k++)
+        if (e.path[k].nexthop != paths[k].nexthop || e.path[k].if_index != paths[k].if_index)
+            return false;
+    return true;
+}
+
+/**
+ * @brief 取得一组路径对应的下一跳编号，引用计数加一
+ * @param paths n 条等价路径，顺序不同视为不同的组
+ * @param n 路径数，不超过 ECMP_MAX_PATHS
+ * @return 下一跳编号，下一跳表已满时返回 FIB_NH_NONE
+ */
+static uint32_t acquire_nexthop(const NextHopPath *paths, uint32_t n) {
+    uint32_t idx = FIB_NH_NONE;
+    for (uint32_t i = 0; i < nh_top; i++) {
+        if (nextHopRef[i] == 0) {
+            if (idx == FIB_NH_NONE)
+                idx = i;
+        } else if (same_paths(nextHop[i], paths, n)) {
+            nextHopRef[i]++;
+            return i;
+        }
+    }
+    if (idx == FIB_NH_NONE) {
+        if (nh_top == NH_LIMIT)
+            return FIB_NH_NONE;
+        idx = nh_top++;
+    }
+    // 空闲的编号不在任何一份 FIB 中，可以直接写
+    nextHop[idx].n = n;
+    for (uint32_t k = 0; k < n; k++)
+        nextHop[idx].path[k] = paths[k];
+    nextHopRef[idx] = 1;
+    return idx;
+}
+
+static void release_nexthop(uint32_t nh) {
+    nextHopRef[nh]--;
+}
+
+static_assert(FIB_MAX_NEXTHOP <= ROUTE_NH_NONE, "RouteEntry::nh is too narrow");
+static_assert(sizeof(RouteEntry) == 8, "RouteEntry should be packed into 8 bytes");
+
+// 第 i 条路由在 FIB 中的下一跳编号，没有进入 FIB 时为 FIB_NH_NONE
+static inline uint32_t entry_nh(int i) {
+    return tableEntry[i].nh == ROUTE_NH_NONE ? FIB_NH_NONE : tableEntry[i].nh;
+}
+
+// 第 i 项改变了
+static inline void touch_entry(int i) {
+    tableVersion[i / ROUTE_CHUNK_SIZE]++;
+}
+
+// 把 entry 存放到第 i 项，nh 为它在 FIB 中的下一跳编号
+static void store_entry(int i, const RoutingTableEntry &entry, uint32_t nh) {
+    touch_entry(i);
+    RouteEntry &e = tableEntry[i];
+    e.addr = entry.addr;
+    e.len = entry.len;
+    e.metric = entry.metric < RIP_INFINITY ? entry.metric : RIP_INFINITY;
+    e.if_index = entry.if_index;
+    e.nh = nh == FIB_NH_NONE ? ROUTE_NH_NONE : nh;
+    tableInfo[i].nexthop = entry.nexthop;
+    tableInfo[i].from = entry.from;
+    for (uint32_t k = 0; k < ECMP_MAX_PATHS; k++)
+        tableInfo[i].path_time[k] = 0;
+}
+
+static inline uint32_t index_hash(uint32_t addr, uint32_t len) {
+    return ((addr * 2654435761u) ^ len) * 2654435761u >> (32 - index_bits);
+}
+
+/**
+ * @brief 在哈希索引中找到 addr/len 所在的位置
+ * @return 表项对应的槽位，或者它应该被放入的空槽位
+ */
+static uint32_t index_slot(uint32_t addr, uint32_t len) {
+    uint32_t mask = (1u << index_bits) - 1;
+    uint32_t i = index_hash(addr, len);
+    while (route_index[i] != INDEX_EMPTY &&
+           (tableEntry[route_index[i]].addr != addr || tableEntry[route_index[i]].len != len))
+        i = (i + 1) & mask;
+    return i;
+}
+
+/**
+ * @brief 在路由表中按照 addr 和 len 精确查找
+ * @return 找到则返回表项序号，否则返回 -1
+ */
+int query_router_entry(uint32_t addr, uint32_t len) {
+    if (p == 0)
+        return -1;
+    return route_index[index_slot(addr, len)];
+}
+
+/**
+ * @brief 保证路由表和索引还能再放下一项
+ * @return 内存不足时返回 false
+ */
+static bool reserve_entry() {
+    if (p == table_cap) {
+        int cap = table_cap ? table_cap * 2 : 64;
+        RouteEntry *e = (RouteEntry *) realloc(tableEntry, cap * sizeof(RouteEntry));
+        if (e == NULL)
+            return false;
+        tableEntry = e;
+        RouteInfo *info = (RouteInfo *) realloc(tableInfo, cap * sizeof(RouteInfo));
+        if (info == NULL)
+            return false;
+        tableInfo = info;
+        int chunks = (table_cap + ROUTE_CHUNK_SIZE - 1) / ROUTE_CHUNK_SIZE;
+        int new_chunks = (cap + ROUTE_CHUNK_SIZE - 1) / ROUTE_CHUNK_SIZE;
+        uint32_t *version = (uint32_t *) realloc(tableVersion, new_chunks * sizeof(uint32_t));
+        if (version == NULL)
+            return false;
+        for (int c = chunks; c < new_chunks; c++)
+            version[c] = 0;
+        tableVersion = version;
+        table_cap = cap;
+    }
+    if (index_bits == 0 || (uint32_t) (p + 1) * 2 > (1u << index_bits)) {
+        uint32_t bits = index_bits ? index_bits + 1 : 7;
+        int *idx = (int *) malloc(sizeof(int) << bits);
+        if (idx == NULL)
+            return false;
+        free(route_index);
+        route_index = idx;
+        index_bits = bits;
+        for (uint32_t i = 0; i < (1u << bits); i++)
+            route_index[i] = INDEX_EMPTY;
+        for (int i = 0; i < p; i++)
+            route_index[index_slot(tableEntry[i].addr, tableEntry[i].len)] = i;
+    }
+    return true;
+}
+
+// 从索引中删除槽位 i ，后面的项往回移动以保持线性探测的连续性
+static void index_erase(uint32_t i) {
+    uint32_t mask = (1u << index_bits) - 1;
+    for (uint32_t j = (i + 1) & mask; route_index[j] != INDEX_EMPTY; j = (j + 1) & mask) {
+        uint32_t k = index_hash(tableEntry[route_index[j]].addr, tableEntry[route_index[j]].len);
+        // k 不在 (i, j] 中时 j 可以移到 i
+        if (i <= j ? (k <= i || k > j) : (k <= i && k > j)) {
+            route_index[i] = route_index[j];
+            i = j;
+        }
+    }
+    route_index[i] = INDEX_EMPTY;
+}
+
+#if !FIB_AGGREGATE
+/**
+ * @brief 找到 FIB 中覆盖 addr/len 的次长前缀，即从 FIB 中删除 addr/len 后接替它的表项
+ * @return 找到则返回表项序号，否则返回 -1
+ */
+static int find_cover(uint32_t addr, uint32_t len) {
+    for (int l = (int) len - 1; l >= 0; l--) {
+        int i = query_router_entry(addr & un_mask[l], l);
+        if (i >= 0 && tableEntry[i].nh != ROUTE_NH_NONE)
+            return i;
+    }
+    return -1;
+}
+#endif
+
+// 逆序撤销一份 FIB 上的前 n 个改动
+static void fib_undo(Fib *f, const FibOp *ops, size_t n) {
+    while (n-- > 0) {
+        if (ops[n].old_nh != FIB_NH_NONE)
+            fib_insert(f, ops[n].addr, ops[n].len, ops[n].old_nh);
+        else
+            fib_remove(f, ops[n].addr, ops[n].len, ops[n].old_cover_nh, ops[n].old_cover_len);
+    }
+}
+
+/**
+ * @brief 按顺序把 ops 应用到一份 FIB 上
+ * @return 成功返回 true ，空间不足时撤销已经做的改动并返回 false
+ */
+static bool fib_apply(Fib *f, const FibOp *ops, size_t n) {
+    for (size_t k = 0; k < n; k++) {
+        const FibOp &op = ops[k];
+        bool ok = op.new_nh == FIB_NH_NONE ? fib_remove(f, op.addr, op.len, op.new_cover_nh, op.new_cover_len)
+                                            : fib_insert(f, op.addr, op.len, op.new_nh);
+        if (!ok) {
+            fib_undo(f, ops, k);
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * @brief 修改一个前缀在 FIB 中的下一跳，两份 FIB 都改好后返回
+ * @param nh 新的下一跳编号，FIB_NH_NONE 表示从 FIB 中删除
+ * @param old_nh 原来的下一跳编号，原来不在 FIB 中则为 FIB_NH_NONE
+ * @return 成功返回 true ，FIB 空间不足时返回 false 且 FIB 保持原样
+ *
+ * 调用时 RIB 中 addr/len 以外的表项应该已经是修改后的样子。
+ * 启用聚合时 FIB 中的是聚合后的前缀集合，一次修改可能对应 FIB 中的多个改动，它们一起切换。
+ */
+static bool fib_change(uint32_t addr, uint32_t len, uint32_t nh, uint32_t old_nh) {
+    const FibOp *ops;
+    size_t n;
+    if (fib_active == NULL)
+        return false;
+#if FIB_AGGREGATE
+    if (!aggr_update(addr, len, nh, &ops, &n))
+        return false;
+#else
+    FibOp op;
+    int cover = find_cover(addr, len);
+    op.addr = addr;
+    op.len = len;
+    op.old_nh = old_nh;
+    op.new_nh = nh;
+    op.old_cover_nh = op.new_cover_nh = cover >= 0 ? entry_nh(cover) : FIB_NH_NONE;
+    op.old_cover_len = op.new_cover_len = cover >= 0 ? tableEntry[cover].len : 0;
+    ops = &op;
+    n = 1;
+#endif
+    bool ok = false;
+    if (fib_apply(fib[fib_cur ^ 1], ops, n)) {
+        fib_publish();
+        if (fib_apply(fib[fib_cur ^ 1], ops, n)) {
+            ok = true;
+        } else {
+            // 旧的那份空间不足，它没有被改动：切换回去，再撤销新的那份上的改动
+            fib_publish();
+            fib_undo(fib[fib_cur ^ 1], ops, n);
+        }
+    }
+#if FIB_AGGREGATE
+    if (!ok)
+        aggr_update(addr, len, old_nh, &ops, &n); // 恢复聚合的状态，FIB 已经是原来的样子
+#endif
+    return ok;
+}
+
+/**
+ * @brief 把 addr/len 在 FIB 中的下一跳编号从 old_nh 换成 nh（已经取得引用）
+ * @return 成功时释放 old_nh 并返回 true ；失败时释放 nh ，FIB 保持原样
+ */
+static bool switch_nexthop(uint32_t addr, uint32_t len, uint32_t nh, uint32_t old_nh) {
+    if (nh != old_nh && !fib_change(addr, len, nh, old_nh)) {
+        if (nh != FIB_NH_NONE)
+            release_nexthop(nh);
+        return false;
+    }
+    if (old_nh != FIB_NH_NONE)
+        release_nexthop(old_nh);
+    return true;
+}
+
 /**
  * @brief 插入/删除一条路由表表项
  * @param insert 如果要插入则为 true ，要删除则为 false
  * @param entry 要插入/删除的表项
  * 
- * 插入时如果已经存在一条 addr 和 len 都相同的表项，则替换掉原有的。
+ * 插入时如果已经存在一条 addr 和 len 都相同的表项，则替换掉原有的（包括它的所有等价路径）。
  * 删除时按照 addr 和 len 匹配。
+ * 路由表和 FIB 在这里同步更新，其他地方不应直接修改 tableEntry 。
+ * 只有转发结果（是否可达、nexthop 、if_index）改变时才会修改 FIB 。
+ * 两份 FIB 依次修改，中间切换一次，所以转发线程中的查询在修改期间也不会被阻塞。
  */
 void update(bool insert, RoutingTableEntry entry) {
-    //entry.addr = ntohl(entry.addr);
+    int i = query_router_entry(entry.addr, entry.len);
     if (insert) {
-        for (int i = 0; i < p; i++) {
-            if (tableEntry[i].addr == entry.addr && tableEntry[i].len == entry.len) {
-                tableEntry[i] = entry;
-                return;
-            }
+        if (entry.len > 32 || entry.if_index > ROUTE_MAX_IF_INDEX)
+            return; // 无法存放
+        if (i < 0 && !reserve_entry())
+            return; // 内存不足
+        uint32_t old_nh = i >= 0 ? entry_nh(i) : FIB_NH_NONE;
+        uint32_t nh = FIB_NH_NONE;
+        if (entry.metric < RIP_INFINITY) {
+            NextHopPath path = {entry.nexthop, entry.if_index};
+            nh = acquire_nexthop(&path, 1);
+            if (nh == FIB_NH_NONE)
+                return; // 下一跳表已满
         }
-        tableEntry[p++] = entry;
+        if (!switch_nexthop(entry.addr, entry.len, nh, old_nh))
+            return;
+        if (i < 0) {
+            i = p++;
+            tableInfo[i].timer = ROUTE_TIMER_NONE;
+            store_entry(i, entry, nh);
+            route_index[index_slot(entry.addr, entry.len)] = i;
+        } else {
+            store_entry(i, entry, nh);
+        }
+    } else if (i >= 0) {
+        uint32_t nh = entry_nh(i);
+        // 删除也可能需要空间（重新编译的引擎，或者聚合时插入别的前缀），失败时保留这条表项
+        if (nh != FIB_NH_NONE && !fib_change(entry.addr, entry.len, FIB_NH_NONE, nh))
+            return;
+        index_erase(index_slot(entry.addr, entry.len));
+        touch_entry(i);
+        if (i != --p) {
+            touch_entry(p);
+            // 最后一项移到 i ，索引中指向它的序号也要改
+            tableEntry[i] = tableEntry[p];
+            tableInfo[i] = tableInfo[p];
+            route_index[index_slot(tableEntry[i].addr, tableEntry[i].len)] = i;
+        }
+        if (nh != FIB_NH_NONE)
+            release_nexthop(nh);
+    }
+}
+
+/**
+ * @brief 取得一条路由的全部等价路径
+ * @param i 表项序号
+ * @param nexthop 长度为 ECMP_MAX_PATHS 的数组，写入每条路径的 nexthop
+ * @param if_index 长度为 ECMP_MAX_PATHS 的数组，写入每条路径的 if_index
+ * @return 路径数，不可达的路由只有一条路径
+ */
+uint32_t route_paths(int i, uint32_t *nexthop, uint32_t *if_index) {
+    uint32_t nh = entry_nh(i);
+    if (nh == FIB_NH_NONE) {
+        nexthop[0] = tableInfo[i].nexthop;
+        if_index[0] = tableEntry[i].if_index;
+        return 1;
+    }
+    for (uint32_t k = 0; k < nextHop[nh].n; k++) {
+        nexthop[k] = nextHop[nh].path[k].nexthop;
+        if_index[k] = nextHop[nh].path[k].if_index;
+    }
+    return nextHop[nh].n;
+}
+
+/**
+ * @brief 给路由增加/删除一条等价路径
+ * @param insert 增加则为 true ，删除则为 false
+ * @param entry addr 和 len 指定路由，nexthop 和 if_index 指定路径
+ * @return 成功返回 true
+ *
+ * 增加时如果还没有这条路由就和 update 一样插入；已有的话 metric 必须相同且可达，
+ * 路径已经存在时什么也不做，路径数达到 ECMP_MAX_PATHS 或下一跳表已满时失败。
+ * 删除时按 nexthop 和 if_index 匹配路径，删掉最后一条路径就删除整条路由。
+ * tableInfo 中每条路径的 path_time 随路径一起移动。
+ */
+bool update_path(bool insert, RoutingTableEntry entry) {
+    int i = query_router_entry(entry.addr, entry.len);
+    if (i < 0) {
+        if (!insert)
+            return false;
+        update(true, entry);
+        return query_router_entry(entry.addr, entry.len) >= 0;
+    }
+    NextHopPath paths[ECMP_MAX_PATHS];
+    uint32_t old_nh = entry_nh(i), n = 0, k = 0;
+    if (old_nh != FIB_NH_NONE) {
+        n = nextHop[old_nh].n;
+        for (uint32_t j = 0; j < n; j++)
+            paths[j] = nextHop[old_nh].path[j];
     } else {
-        for (int i = 0; i < p; i++)
-            if (tableEntry[i].addr == entry.addr && tableEntry[i].len == entry.len)
-                tableEntry[i] = tableEntry[--p];
+        paths[n++] = {tableInfo[i].nexthop, tableEntry[i].if_index};
+    }
+    while (k < n && (paths[k].nexthop != entry.nexthop || paths[k].if_index != entry.if_index))
+        k++;
+    if (insert) {
+        if (k < n)
+            return true;
+        uint32_t metric = entry.metric < RIP_INFINITY ? entry.metric : RIP_INFINITY;
+        if (old_nh == FIB_NH_NONE || metric != tableEntry[i].metric || n == ECMP_MAX_PATHS ||
+            entry.if_index > ROUTE_MAX_IF_INDEX)
+            return false;
+        paths[n++] = {entry.nexthop, entry.if_index};
+    } else {
+        if (k == n)
+            return false;
+        if (n == 1) {
+            update(false, entry);
+            return true;
+        }
+        n--;
+        for (uint32_t j = k; j < n; j++)
+            paths[j] = paths[j + 1];
+    }
+    uint32_t nh = acquire_nexthop(paths, n);
+    if (nh == FIB_NH_NONE || !switch_nexthop(entry.addr, entry.len, nh, old_nh))
+        return false;
+    touch_entry(i);
+    tableEntry[i].nh = nh;
+    tableEntry[i].if_index = paths[0].if_index;
+    tableInfo[i].nexthop = paths[0].nexthop;
+    // 每条路径的时间跟着路径移动
+    uint64_t *path_time = tableInfo[i].path_time;
+    if (insert) {
+        path_time[n - 1] = 0;
+    } else {
+        for (uint32_t j = k; j < n; j++)
+            path_time[j] = path_time[j + 1];
+    }
+    return true;
+}
+
+// 聚合时 FIB 中的 AGGR_NH_DROP 表示没有路由
+static inline uint32_t fib_result(uint32_t nh) {
+#if FIB_AGGREGATE
+    return nh == AGGR_NH_DROP ? FIB_NH_NONE : nh;
+#else
+    return nh;
+#endif
+}
+
+// 按流的哈希值在一组等价路径中选一条，哈希值均匀时各条路径的流量也均匀
+static inline const NextHopPath &select_path(uint32_t nh, uint32_t hash) {
+    const NextHopEntry &e = nextHop[nh];
+    return e.path[e.n == 1 ? 0 : (uint64_t) hash * e.n >> 32];
+}
+
+// 只知道目的地址时用它作为流的标识
+static inline uint32_t addr_hash(uint32_t addr) {
+    return addr * 2654435761u;
+}
+
+/**
+ * @brief 进行一次路由表的查询，按照最长前缀匹配原则
+ * @param addr 需要查询的目标地址，大端序
+ * @param hash 流的哈希值（例如 flow_hash 的结果），用于在等价路径中选择
+ * @param nexthop 如果查询到目标，把选中路径的 nexthop 写入
+ * @param if_index 如果查询到目标，把选中路径的 if_index 写入
+ * @return 查到则返回 true ，没查到则返回 false
+ *
+ * 只查询 FIB ，不可达（metric 达到 RIP_INFINITY）的路由不会被查到。
+ * 默认路由（len 为 0）和其他前缀一样参与匹配；原来的线性扫描要求 len 大于 0 ，查不到它。
+ */
+bool query_flow(uint32_t addr, uint32_t hash, uint32_t *nexthop, uint32_t *if_index) {
+    uint64_t gen;
+    const Fib *f = read_lock(&gen);
+    uint32_t nh;
+    if (!dcache_find(addr, gen, &nh)) {
+        nh = f ? fib_result(fib_lookup(f, addr)) : FIB_NH_NONE;
+        dcache_fill(addr, gen, nh);
     }
+    if (nh != FIB_NH_NONE) {
+        const NextHopPath &path = select_path(nh, hash);
+        *if_index = path.if_index;
+        *nexthop = path.nexthop;
+    } else {
+        *nexthop = 0;
+        *if_index = 0;
+    }
+    read_unlock(gen);
+    return nh != FIB_NH_NONE;
 }
 
 /**
@@ -61,31 +689,74 @@ void update(bool insert, RoutingTableEntry entry) {
  * @param addr 需要查询的目标地址，大端序
  * @param nexthop 如果查询到目标，把表项的 nexthop 写入
  * @param if_index 如果查询到目标，把表项的 if_index 写入
- * @param metric 如果查询到目标，把表项的 metric 写入
  * @return 查到则返回 true ，没查到则返回 false
+ *
+ * 有多条等价路径时按目的地址选择，需要按流分散时使用 query_flow 。
  */
-bool query(uint32_t addr, uint32_t *nexthop, uint32_t *if_index, uint32_t *metric) {
-    //addr = ntohl(addr);
-    uint32_t max_len = 0, ans = 0xFFFFFFFF;
-    for (int i = 0; i < p; i++) {
-        if (tableEntry[i].len > max_len && (tableEntry[i].addr == (addr & un_mask[tableEntry[i].len]))) {
-            max_len = tableEntry[i].len;
-            ans = i;
+bool query(uint32_t addr, uint32_t *nexthop, uint32_t *if_index) {
+    return query_flow(addr, addr_hash(addr), nexthop, if_index);
+}
+
+/**
+ * @brief 批量进行路由表的查询，结果与逐个调用 query 相同
+ * @param addrs n 个需要查询的目标地址，大端序
+ * @param n 地址个数
+ * @param nexthop 长度为 n 的数组，写入每个地址的 nexthop ，没查到时为 0
+ * @param if_index 长度为 n 的数组，写入每个地址的 if_index ，没查到时为 0
+ * @param found 长度为 n 的数组，写入每个地址是否查到（和 query 的返回值相同）
+ * @return 查到的地址个数
+ *
+ * 转发时一次收到一批包的话，用这个函数可以让不同包的查询交错进行，隐藏访存的延迟。
+ */
+size_t query_batch(const uint32_t *addrs, size_t n, uint32_t *nexthop, uint32_t *if_index, bool *found) {
+    uint32_t nh[FIB_BATCH], miss_addr[FIB_BATCH], miss_nh[FIB_BATCH];
+    size_t miss_idx[FIB_BATCH];
+    size_t n_found = 0;
+    uint64_t gen;
+    const Fib *f = read_lock(&gen);
+    for (size_t base = 0; base < n; base += FIB_BATCH) {
+        size_t m = n - base < FIB_BATCH ? n - base : FIB_BATCH;
+        // 缓存未命中的地址一起交给 FIB 批量查询
+        size_t misses = 0;
+        for (size_t i = 0; i < m; i++) {
+            if (!dcache_find(addrs[base + i], gen, &nh[i])) {
+                miss_idx[misses] = i;
+                miss_addr[misses++] = addrs[base + i];
+            }
+        }
+        if (f)
+            fib_lookup_batch(f, miss_addr, misses, miss_nh);
+        else
+            for (size_t j = 0; j < misses; j++)
+                miss_nh[j] = FIB_NH_NONE;
+        for (size_t j = 0; j < misses; j++) {
+            nh[miss_idx[j]] = fib_result(miss_nh[j]);
+            dcache_fill(miss_addr[j], gen, nh[miss_idx[j]]);
+        }
+        for (size_t i = 0; i < m; i++) {
+            if (nh[i] != FIB_NH_NONE) {
+                const NextHopPath &path = select_path(nh[i], addr_hash(addrs[base + i]));
+                nexthop[base + i] = path.nexthop;
+                if_index[base + i] = path.if_index;
+                found[base + i] = true;
+                n_found++;
+            } else {
+                nexthop[base + i] = 0;
+                if_index[base + i] = 0;
+                found[base + i] = false;
+            }
         }
     }
-    if (~ans) {
-        *if_index = tableEntry[ans].if_index;
-        *nexthop = tableEntry[ans].nexthop;
-        *metric = tableEntry[ans].metric;
-        return true;
-    }
-    *nexthop = 0;
-    *if_index = 0;
-    *metric = 16;
-    return false;
+    read_unlock(gen);
+    return n_found;
 }
 
-bool query(uint32_t addr, uint32_t *nexthop, uint32_t *if_index) {
-    uint32_t tmp;
-    return query(addr, nexthop, if_index, &tmp);
+/**
+ * @brief 转发表占用的内存
+ * @return 两份转发表一共分配的字节数
+ *
+ * 和 update 一样只能在控制面调用。
+ */
+size_t fib_memory_usage() {
+    return fib_active ? fib_memory(fib[0]) + fib_memory(fib[1]) : 0;
 }
@@ -3,37 +3,183 @@
 #include <stdint.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 extern void update(bool insert, RoutingTableEntry entry);
 extern bool query(uint32_t addr, uint32_t *nexthop, uint32_t *if_index);
-char buffer[1024];
+extern size_t query_batch(const uint32_t *addrs, size_t n, uint32_t *nexthop, uint32_t *if_index, bool *found);
+
+/*
+  输入可能有几百万行，用 stdio 逐行 sscanf/printf 的话时间几乎都花在输入输出上。
+  这里把整个输入映射（不是普通文件时读入）到内存中手工解析，
+  连续的查询攒起来用 query_batch 一起查，输出先写到缓冲区里，满了再一次 write 出去。
+*/
+
+#define QUERY_BLOCK 256      // 一次批量查询的最大地址数
+#define OUT_BUFFER (1 << 20) // 输出缓冲区大小
+
+static char out[OUT_BUFFER];
+static size_t out_len = 0;
+static uint32_t pending[QUERY_BLOCK]; // 还没有查询的地址
+static size_t n_pending = 0;
+
+static void flush_output() {
+  size_t done = 0;
+  while (done < out_len) {
+    ssize_t n = write(1, out + done, out_len - done);
+    if (n <= 0)
+      break;
+    done += n;
+  }
+  out_len = 0;
+}
+
+static inline void put_hex(uint32_t x) {
+  static const char digits[] = "0123456789abcdef";
+  out[out_len++] = '0';
+  out[out_len++] = 'x';
+  for (int shift = 28; shift >= 0; shift -= 4)
+    out[out_len++] = digits[(x >> shift) & 0xF];
+}
+
+static inline void put_dec(uint32_t x) {
+  char tmp[10];
+  int n = 0;
+  do {
+    tmp[n++] = '0' + x % 10;
+    x /= 10;
+  } while (x);
+  while (n)
+    out[out_len++] = tmp[--n];
+}
+
+// 查询攒下的地址并按顺序输出结果
+static void flush_queries() {
+  uint32_t nexthop[QUERY_BLOCK], if_index[QUERY_BLOCK];
+  bool found[QUERY_BLOCK];
+  query_batch(pending, n_pending, nexthop, if_index, found);
+  for (size_t i = 0; i < n_pending; i++) {
+    if (out_len + 32 > OUT_BUFFER)
+      flush_output();
+    if (found[i]) {
+      put_hex(nexthop[i]);
+      out[out_len++] = ' ';
+      put_dec(if_index[i]);
+      out[out_len++] = '\n';
+    } else {
+      memcpy(out + out_len, "Not Found\n", 10);
+      out_len += 10;
+    }
+  }
+  n_pending = 0;
+}
+
+// 跳过逗号和空白，读一个十六进制数（可以带 0x 前缀）
+static inline uint32_t parse_hex(const char *&s, const char *end) {
+  while (s < end && (*s == ',' || *s == ' '))
+    s++;
+  if (s + 1 < end && s[0] == '0' && (s[1] == 'x' || s[1] == 'X'))
+    s += 2;
+  uint32_t x = 0;
+  for (; s < end; s++) {
+    uint32_t d;
+    if (*s >= '0' && *s <= '9')
+      d = *s - '0';
+    else if ((*s | 0x20) >= 'a' && (*s | 0x20) <= 'f')
+      d = (*s | 0x20) - 'a' + 10;
+    else
+      break;
+    x = x << 4 | d;
+  }
+  return x;
+}
+
+static inline uint32_t parse_dec(const char *&s, const char *end) {
+  while (s < end && (*s == ',' || *s == ' '))
+    s++;
+  uint32_t x = 0;
+  for (; s < end && *s >= '0' && *s <= '9'; s++)
+    x = x * 10 + (*s - '0');
+  return x;
+}
+
+/**
+ * @brief 把标准输入的全部内容放到内存中
+ * @param size 写入内容的长度
+ * @return 内容的起始位置，失败时返回 NULL
+ *
+ * 标准输入是普通文件时直接 mmap ，否则（例如管道）读到 malloc 的缓冲区中。
+ */
+static const char *load_input(size_t *size) {
+  struct stat st;
+  if (fstat(0, &st) == 0 && S_ISREG(st.st_mode)) {
+    *size = st.st_size;
+    if (st.st_size == 0)
+      return "";
+    void *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE | MAP_POPULATE, 0, 0);
+    if (data != MAP_FAILED) {
+      madvise(data, st.st_size, MADV_SEQUENTIAL);
+      return (const char *)data;
+    }
+  }
+  size_t cap = 1 << 20, len = 0;
+  char *buf = (char *)malloc(cap);
+  while (buf) {
+    if (len == cap) {
+      char *bigger = (char *)realloc(buf, cap *= 2);
+      if (bigger == NULL)
+        free(buf);
+      buf = bigger;
+      continue;
+    }
+    ssize_t n = read(0, buf + len, cap - len);
+    if (n <= 0)
+      break;
+    len += n;
+  }
+  *size = len;
+  return buf;
+}
 
 int main(int argc, char *argv[]) {
-  uint32_t addr, len, if_index, nexthop;
-  char tmp;
-  while (fgets(buffer, sizeof(buffer), stdin)) {
-    if (buffer[0] == 'I') {
-      sscanf(buffer, "%c,%x,%d,%d,%x", &tmp, &addr, &len, &if_index, &nexthop);
-      RoutingTableEntry entry = {
-          .addr = addr, .len = len, .if_index = if_index, .nexthop = nexthop};
+  size_t size;
+  const char *s = load_input(&size);
+  if (s == NULL) {
+    fprintf(stderr, "failed to read input\n");
+    return 1;
+  }
+  const char *end = s + size;
+  while (s < end) {
+    const char *eol = (const char *)memchr(s, '\n', end - s);
+    if (eol == NULL)
+      eol = end;
+    char op = *s++;
+    if (op == 'I') {
+      RoutingTableEntry entry = {};
+      entry.addr = parse_hex(s, eol);
+      entry.len = parse_dec(s, eol);
+      entry.if_index = parse_dec(s, eol);
+      entry.nexthop = parse_hex(s, eol);
+      // 修改前先把之前的查询做完，保证结果按输入的顺序
+      flush_queries();
       update(true, entry);
-    } else if (buffer[0] == 'D') {
-      sscanf(buffer, "%c,%x,%d", &tmp, &addr, &len);
-      RoutingTableEntry entry = {
-        .addr = addr,
-        .len = len,
-        .if_index = 0,
-        .nexthop = 0
-      };
+    } else if (op == 'D') {
+      RoutingTableEntry entry = {};
+      entry.addr = parse_hex(s, eol);
+      entry.len = parse_dec(s, eol);
+      flush_queries();
       update(false, entry);
-    } else if (buffer[0] == 'Q') {
-      sscanf(buffer, "%c,%x", &tmp, &addr);
-      if (query(addr, &nexthop, &if_index)) {
-        printf("0x%08x %d\n", nexthop, if_index);
-      } else {
-        printf("Not Found\n");
-      }
+    } else if (op == 'Q') {
+      pending[n_pending++] = parse_hex(s, eol);
+      if (n_pending == QUERY_BLOCK)
+        flush_queries();
     }
+    s = eol + 1;
   }
+  flush_queries();
+  flush_output();
   return 0;
-}
\ No newline at end of file
+}
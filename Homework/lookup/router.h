@@ -1,5 +1,8 @@
 #include <stdint.h>
 
+// RIP 中表示不可达的 metric
+#define RIP_INFINITY 16
+
 // 路由表的一项
 typedef struct {
     uint32_t addr; // 地址
@@ -9,4 +12,37 @@ typedef struct {
     // 为了实现 RIP 协议，需要在这里添加额外的字段
     uint32_t metric;
     uint32_t from;
-} RoutingTableEntry;
\ No newline at end of file
+} RoutingTableEntry;
+
+/*
+  路由表（RIB）在内存中按冷热分开存放：
+  RouteEntry 只有 8 字节，包含按 (addr, len) 查找和生成 RIP 通告时要读的字段，一个缓存行放 8 项；
+  RouteInfo 是很少读的字段，与 RouteEntry 下标一一对应。
+*/
+
+// 表示路由没有进入 FIB
+#define ROUTE_NH_NONE 0x1FFF
+// 能存放的最大出端口编号
+#define ROUTE_MAX_IF_INDEX 0xFF
+// 一条路由最多的等价路径（ECMP）数
+#define ECMP_MAX_PATHS 4
+// 路由表每这么多项记录一个修改计数（tableVersion），与一个 RIP 包最多的表项数相同
+#define ROUTE_CHUNK_SIZE 25
+
+typedef struct {
+    uint32_t addr;          // 大端序
+    uint32_t len : 6;       // 前缀长度
+    uint32_t metric : 5;    // 超过 RIP_INFINITY 的按 RIP_INFINITY 存放
+    uint32_t if_index : 8;  // 出端口编号
+    uint32_t nh : 13;       // FIB 中的下一跳编号，ROUTE_NH_NONE 表示没有进入 FIB
+} RouteEntry;
+
+// RouteInfo::timer 没有定时器时的值
+#define ROUTE_TIMER_NONE 0xFFFFFFFF
+
+typedef struct {
+    uint32_t nexthop;       // 下一跳的地址，0 表示直连
+    uint32_t from;
+    uint32_t timer;         // 控制面为这条路由设置的定时器编号，新插入的路由为 ROUTE_TIMER_NONE
+    uint64_t path_time[ECMP_MAX_PATHS]; // 控制面为每条等价路径记录的时间，顺序与 route_paths 相同，新的路径为 0
+} RouteInfo;
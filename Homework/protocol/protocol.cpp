@@ -1,7 +1,11 @@
 #include "rip.h"
 #include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
 #include <arpa/inet.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 /*
   在头文件 rip.h 中定义了如下的结构体：
@@ -30,12 +34,107 @@
   需要注意这里的地址都是用 **大端序** 存储的，1.2.3.4 对应 0x04030201 。
 */
 
+// 掩码（小端序）由连续的 1 和连续的 0 组成时，取反后加一只会有一位为 1 ，与取反的值没有公共位
 bool checkMask(const uint32_t mask) {
-    uint32_t p = 0, m = 1;
-    for (; p < 32 && !(mask & m); p++, m <<= 1);
-    for (; p < 32; p++, m <<= 1)
-        if (!(mask & m))
-            return false;
+    uint32_t inv = ~mask;
+    return (inv & (inv + 1)) == 0;
+}
+
+// 一项是否合法：Family 和 Tag（合在一起按 32 位比较）、掩码、Metric ，不带分支
+static inline bool entry_ok(const uint8_t *e, uint32_t family_tag) {
+    return (rip_load32(e) == family_tag) & checkMask(ntohl(rip_load32(e + 8))) & (ntohl(rip_load32(e + 16)) - 1 < 16);
+}
+
+#ifdef __SSE2__
+// 每个 32 位通道内交换字节顺序（SSE2 没有 pshufb ，先交换两个 16 位，再交换每个 16 位中的两个字节）
+static inline __m128i bswap32x4(__m128i v) {
+    v = _mm_shufflehi_epi16(_mm_shufflelo_epi16(v, 0xB1), 0xB1);
+    return _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
+}
+#endif
+
+/**
+ * @brief 检查 n 个连续表项是否都合法
+ * @param entries 第一项的起始位置
+ * @param n 表项个数
+ * @param family_tag 期望的 Family 和 Tag 字段，按本机字节序读出的 32 位值
+ * @return 都合法返回 true
+ *
+ * 每次处理 4 项：从每项的开头和第 4 字节各读 16 字节，经过转置得到 4 项的 Family/Tag 、Mask 、Metric 各一个向量，
+ * 再用向量比较一次检查 4 项。剩下不足 4 项的逐项检查。
+ */
+static bool check_entries(const uint8_t *entries, uint32_t n, uint32_t family_tag) {
+    uint32_t i = 0;
+#ifdef __SSE2__
+    const __m128i expected = _mm_set1_epi32((int) family_tag);
+    const __m128i ones = _mm_set1_epi32(-1);
+    const __m128i bias = _mm_set1_epi32((int) 0x80000000);
+    const __m128i metric_max = _mm_set1_epi32((int) (0x80000000 + 16));
+    __m128i ok = ones;
+    for (; i + 4 <= n; i += 4) {
+        const uint8_t *e = entries + 20 * i;
+        // a[k] = (Family/Tag, Address, Mask, Next Hop)，b[k] = (Address, Mask, Next Hop, Metric)
+        __m128i a0 = _mm_loadu_si128((const __m128i *) e);
+        __m128i a1 = _mm_loadu_si128((const __m128i *) (e + 20));
+        __m128i a2 = _mm_loadu_si128((const __m128i *) (e + 40));
+        __m128i a3 = _mm_loadu_si128((const __m128i *) (e + 60));
+        __m128i b0 = _mm_loadu_si128((const __m128i *) (e + 4));
+        __m128i b1 = _mm_loadu_si128((const __m128i *) (e + 24));
+        __m128i b2 = _mm_loadu_si128((const __m128i *) (e + 44));
+        __m128i b3 = _mm_loadu_si128((const __m128i *) (e + 64));
+        __m128i ft = _mm_unpacklo_epi64(_mm_unpacklo_epi32(a0, a1), _mm_unpacklo_epi32(a2, a3));
+        __m128i mask = _mm_unpacklo_epi64(_mm_unpackhi_epi32(a0, a1), _mm_unpackhi_epi32(a2, a3));
+        __m128i metric = _mm_unpackhi_epi64(_mm_unpackhi_epi32(b0, b1), _mm_unpackhi_epi32(b2, b3));
+
+        __m128i inv = _mm_xor_si128(bswap32x4(mask), ones);
+        __m128i contiguous = _mm_cmpeq_epi32(_mm_and_si128(inv, _mm_sub_epi32(inv, ones)), _mm_setzero_si128());
+        // 无符号比较 metric - 1 < 16 ：加上偏置后做有符号比较
+        __m128i m = _mm_add_epi32(_mm_sub_epi32(bswap32x4(metric), _mm_set1_epi32(1)), bias);
+        __m128i in_range = _mm_cmplt_epi32(m, metric_max);
+        ok = _mm_and_si128(ok, _mm_and_si128(_mm_cmpeq_epi32(ft, expected), _mm_and_si128(contiguous, in_range)));
+    }
+    if (_mm_movemask_epi8(ok) != 0xFFFF)
+        return false;
+#endif
+    bool all = true;
+    for (; i < n; i++)
+        all &= entry_ok(entries + 20 * i, family_tag);
+    return all;
+}
+
+/**
+ * @brief 检查接受到的 IP 包中的 RIP 数据，得到表项的视图，不复制表项
+ * @param packet 接受到的 IP 包
+ * @param len 即 packet 的长度
+ * @param output 把视图写入 *output ，表项通过 rip_view_addr 等函数读出
+ * @return 如果输入是一个合法的 RIP 包返回 true ；否则返回 false
+ *
+ * 检查的内容与 disassemble 相同。和原来的实现一样，Total Length 末尾不足 20 字节的部分也算作一个表项，
+ * 按完整的 20 字节读取并检查；只是这一项超出 len 时不去读它，直接视为不合法。
+ * 所有表项由 check_entries 一起检查，不在第一个非法的表项处提前返回。
+ */
+bool disassemble_view(const uint8_t *packet, uint32_t len, RipView *output) {
+    uint32_t total_len = (uint32_t) packet[2] << 8 | packet[3];
+    uint32_t header_len = (packet[0] & 0x0F) << 2;
+    uint32_t p = header_len + 8; // UDP length = 8, p -> Command
+    if (total_len > len || p + 2 > len)
+        return false;
+
+    uint8_t command = packet[p];
+    if (command != 1 && command != 2) return false; // Check if Command == 1 or 2
+    if (packet[p + 1] != 2) return false; // Check if Version == 2
+
+    uint8_t family_tag[4] = {0, (uint8_t) (command == 1 ? 0 : 2), 0, 0};
+    uint32_t expected = rip_load32(family_tag);
+    const uint8_t *entries = packet + p + 4;
+    uint32_t n = total_len > p + 4 ? (total_len - p - 4 + 19) / 20 : 0;
+    if (n && p + 4 + 20 * n > len)
+        return false;
+    if (!check_entries(entries, n, expected))
+        return false;
+    output->entries = entries;
+    output->numEntries = n;
+    output->command = command;
     return true;
 }
 
@@ -54,59 +153,51 @@ bool checkMask(const uint32_t mask) {
  * Mask 的二进制是不是连续的 1 与连续的 0 组成等等。
  */
 bool disassemble(const uint8_t *packet, uint32_t len, RipPacket *output) {
-    uint16_t total_len = ((uint16_t) packet[2] << 8) + packet[3];
-    if (total_len > len) return false;
-
-    uint32_t header_len = packet[0] & 0x0F;
-    header_len <<= 2; // IPV4 header length
-    uint32_t p = header_len + 8; // UDP length = 8, p -> Command
-
-    if (packet[p] != 1 && packet[p] != 2) return false; // Check if Command == 1 or 2
-    output->command = packet[p];
-    uint16_t expected_family = output->command == 1 ? 0 : 2;
-
-    p += 1; // p -> Version
-    if (packet[p] != 2) return false; // Check if Version == 2
-
-    p += 3; // p -> IP Address
-    uint32_t i = 0;
-    for (; p < total_len; i++) {
-        uint16_t family = ((uint16_t) packet[p] << 8) + packet[p + 1];
-        if (family != expected_family) return false; // Check if family == expected_family
-
-        p += 2; // p -> Tag
-        uint16_t tag = ((uint16_t) packet[p] << 8) + packet[p + 1];
-        if (tag != 0) return false; // Check if tag == 0
-
-        p += 2; // p -> Address
-        output->entries[i].addr = 0;
-        for (int j = 3; j >= 0; j--)
-            output->entries[i].addr = (output->entries[i].addr << 8) + packet[p + j];
-
-        p += 4; // p -> Mask
-        output->entries[i].mask = 0;
-        for (int j = 3; j >= 0; j--)
-            output->entries[i].mask = (output->entries[i].mask << 8) + packet[p + j];
-        if (!checkMask(ntohl(output->entries[i].mask))) return false; // Check if Mask is valid
-
-        p += 4; // p -> NextHop
-        output->entries[i].nexthop = 0;
-        for (int j = 3; j >= 0; j--)
-            output->entries[i].nexthop = (output->entries[i].nexthop << 8) + packet[p + j];
-
-        p += 4; // p -> Metric
-        output->entries[i].metric = 0;
-        for (int j = 3; j >= 0; j--)
-            output->entries[i].metric = (output->entries[i].metric << 8) + packet[p + j];
-        if (ntohl(output->entries[i].metric) < 1 || 16 < ntohl(output->entries[i].metric))
-            return false; // Check if 1 <= Metric <= 16
-
-        p += 4; // p -> Family
+    RipView view;
+    if (!disassemble_view(packet, len, &view) || view.numEntries > RIP_MAX_ENTRY)
+        return false;
+    output->command = view.command;
+    output->numEntries = view.numEntries;
+    for (uint32_t i = 0; i < view.numEntries; i++) {
+        output->entries[i].addr = rip_view_addr(&view, i);
+        output->entries[i].mask = rip_view_mask(&view, i);
+        output->entries[i].nexthop = rip_view_nexthop(&view, i);
+        output->entries[i].metric = rip_view_metric(&view, i);
     }
-    output->numEntries = i;
     return true;
 }
 
+/**
+ * @brief 与 assemble 相同，但在写入的同时把写入的数据累加到校验和的部分和上
+ * @param rip 一个 RipPacket 结构体
+ * @param buffer 一个足够大的缓冲区，RIP 协议的数据写在这里
+ * @param sum 输入时为之前的部分和（例如 UDP 伪首部和首部的），返回时加上了写入的数据
+ * @return 写入 buffer 的数据长度
+ *
+ * 部分和按本机字节序的 32 位字累加，与 csum.h 中 csum_partial 的约定相同，可以直接交给 csum_fold。
+ * RipEntry 的字段本来就是大端序存放的，按 32 位整体写入即可，不需要逐字节拆开。
+ */
+uint32_t assemble_csum(const RipPacket *rip, uint8_t *buffer, uint32_t *sum) {
+    uint8_t head[4] = {rip->command, 2, 0, 0};
+    uint8_t family_tag[4] = {0, (uint8_t) (rip->command == 1 ? 0 : 2), 0, 0};
+    uint32_t h, t;
+    memcpy(&h, head, 4);
+    memcpy(&t, family_tag, 4);
+    memcpy(buffer, &h, 4);
+    uint64_t acc = (uint64_t) *sum + h;
+    uint32_t p = 4;
+    for (uint32_t i = 0; i < rip->numEntries; i++, p += 20) {
+        const RipEntry &e = rip->entries[i];
+        uint32_t w[5] = {t, e.addr, e.mask, e.nexthop, e.metric};
+        memcpy(buffer + p, w, 20);
+        acc += (uint64_t) t + e.addr + e.mask + e.nexthop + e.metric;
+    }
+    acc = (acc >> 32) + (acc & 0xFFFFFFFF);
+    acc = (acc >> 32) + (acc & 0xFFFFFFFF);
+    *sum = (uint32_t) acc;
+    return p;
+}
+
 /**
  * @brief 从 RipPacket 的数据结构构造出 RIP 协议的二进制格式
  * @param rip 一个 RipPacket 结构体
@@ -118,23 +209,6 @@ bool disassemble(const uint8_t *packet, uint32_t len, RipPacket *output) {
  * 需要注意一些没有保存在 RipPacket 结构体内的数据的填写。
  */
 uint32_t assemble(const RipPacket *rip, uint8_t *buffer) {
-    buffer[0] = rip->command;
-    buffer[1] = 2;
-    buffer[2] = buffer[3] = 0;
-    uint16_t family = rip->command == 1 ? 0 : 2;
-    uint32_t p = 4;
-    for (int i = 0; i < rip->numEntries; i++) {
-        buffer[p++] = 0;
-        buffer[p++] = family;
-        buffer[p++] = buffer[p++] = 0;
-        for (int j = 0; j < 4; j++)
-            buffer[p++] = (rip->entries[i].addr >> (8 * j)) & 0xFF;
-        for (int j = 0; j < 4; j++)
-            buffer[p++] = (rip->entries[i].mask >> (8 * j)) & 0xFF;
-        for (int j = 0; j < 4; j++)
-            buffer[p++] = (rip->entries[i].nexthop >> (8 * j)) & 0xFF;
-        for (int j = 0; j < 4; j++)
-            buffer[p++] = (rip->entries[i].metric >> (8 * j)) & 0xFF;
-    }
-    return p;
+    uint32_t sum = 0;
+    return assemble_csum(rip, buffer, &sum);
 }
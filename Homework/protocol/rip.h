@@ -1,4 +1,5 @@
 #include <stdint.h>
+#include <string.h>
 #define RIP_MAX_ENTRY 25
 typedef struct {
   // all fields are big endian
@@ -17,4 +18,39 @@ typedef struct {
   // we don't store 'version', as it is always 2
   // we don't store 'zero', as it is always 0
   RipEntry entries[RIP_MAX_ENTRY];
-} RipPacket;
\ No newline at end of file
+} RipPacket;
+
+/*
+  RipView 是收到的包中 RIP 表项的视图，不复制数据，表项的字段通过下面的函数直接从包中读出。
+  每项 20 字节：Address Family 、Route Tag 、Address 、Mask 、Next Hop 、Metric 。
+  视图只在包的缓冲区没有被改写时有效。
+*/
+typedef struct {
+  const uint8_t *entries; // 第一项的起始位置
+  uint32_t numEntries;
+  uint8_t command;
+} RipView;
+
+// 不要求对齐地读出 32 位，保持包中的字节顺序（大端序）
+static inline uint32_t rip_load32(const uint8_t *p) {
+  uint32_t v;
+  memcpy(&v, p, 4);
+  return v;
+}
+
+// 第 i 项的各个字段，与 RipEntry 相同都是大端序
+static inline uint32_t rip_view_addr(const RipView *view, uint32_t i) {
+  return rip_load32(view->entries + 20 * i + 4);
+}
+
+static inline uint32_t rip_view_mask(const RipView *view, uint32_t i) {
+  return rip_load32(view->entries + 20 * i + 8);
+}
+
+static inline uint32_t rip_view_nexthop(const RipView *view, uint32_t i) {
+  return rip_load32(view->entries + 20 * i + 12);
+}
+
+static inline uint32_t rip_view_metric(const RipView *view, uint32_t i) {
+  return rip_load32(view->entries + 20 * i + 16);
+}